@@ -21,6 +21,10 @@
 
 volatile uint32_t *lapic;  // Initialized in mp.c
 
+uint32_t lapic_quantum = LAPIC_QUANTUM;	// Scheduling quantum in microseconds
+uint32_t lapic_tpu = LAPIC_DEFTPU;	// Timer ticks per us, from lapic_calib()
+uint32_t lapic_tscpu = LAPIC_DEFTSCPU;	// TSC ticks per us, from lapic_calib()
+
 
 static void
 lapicw(int index, int value)
@@ -29,6 +33,61 @@ lapicw(int index, int value)
 	lapic[ID];  // wait for write to finish, by reading
 }
 
+// 8253/8254 Programmable Interval Timer, used only to calibrate the LAPIC.
+#define IO_PIT		0x40		// PIT I/O ports 0x40-0x43
+#define IO_PPI		0x61		// Port B: PIT channel 2 gate and output
+#define PIT_HZ		1193182		// PIT input clock frequency
+#define PIT_CALMS	10		// Calibration interval in milliseconds
+#define PIT_SPINMAX	100000000	// Give up if the PIT never fires
+
+// Measure how many LAPIC timer and TSC ticks elapse per microsecond,
+// by letting the timer count down freely while PIT channel 2
+// counts off a known interval in one-shot mode.
+static void
+lapic_calib(void)
+{
+	uint8_t ppi = inb(IO_PPI) & ~0x03;	// gate off, speaker off
+	outb(IO_PPI, ppi);
+	outb(IO_PIT+3, 0xb0);		// channel 2, lo/hi byte, mode 0
+	outb(IO_PIT+2, (PIT_HZ * PIT_CALMS / 1000) & 0xff);
+	outb(IO_PIT+2, (PIT_HZ * PIT_CALMS / 1000) >> 8);
+
+	lapicw(TIMER, MASKED | T_LTIMER);
+	lapicw(TICR, 0xffffffff);
+	uint64_t tsc = rdtsc();
+	outb(IO_PPI, ppi | 0x01);		// open the gate: start counting
+	int i;
+	for (i = 0; i < PIT_SPINMAX; i++)
+		if (inb(IO_PPI) & 0x20)		// channel 2 reached terminal count
+			break;
+	uint32_t ticks = 0xffffffff - lapic[TCCR];
+	tsc = rdtsc() - tsc;
+	outb(IO_PPI, ppi);
+	lapicw(TICR, 0);
+
+	if (i == PIT_SPINMAX || ticks < PIT_CALMS * 1000) {
+		warn("lapic_calib: no usable PIT, assuming %d ticks/us",
+			LAPIC_DEFTPU);
+		return;
+	}
+	lapic_tpu = ticks / (PIT_CALMS * 1000);
+	if (tsc >= PIT_CALMS * 1000)
+		lapic_tscpu = tsc / (PIT_CALMS * 1000);
+	cprintf("lapic: %d timer ticks/us, %d TSC ticks/us, quantum %dus\n",
+		lapic_tpu, lapic_tscpu, lapic_quantum);
+}
+
+// Convert a microsecond interval into an initial timer count.
+static uint32_t
+lapic_ticks(uint32_t us)
+{
+	if (us == 0)
+		us = 1;
+	if (us > 0xffffffff / lapic_tpu)
+		return 0xffffffff;
+	return us * lapic_tpu;
+}
+
 void
 lapic_init()
 {
@@ -38,14 +97,15 @@ lapic_init()
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (T_IRQ0 + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
+	// The timer counts down at bus frequency from lapic[TICR]
+	// and then issues an interrupt.  All CPUs share the same bus clock,
+	// so only the boot CPU needs to calibrate it against the PIT.
 	lapicw(TDCR, X1);
+	if (cpu_onboot())
+		lapic_calib();
 	lapicw(TIMER, PERIODIC | T_LTIMER);
-
-	// If we cared more about precise timekeeping,
-	// we would calibrate TICR with another time source such as the PIT.
-	lapicw(TICR, 10000000);
+	lapicw(TICR, lapic_ticks(lapic_quantum));
+	cpu_cur()->timer = PERIODIC | T_LTIMER;
 
 	// Disable logical interrupt lines.
 	lapicw(LINT0, MASKED);
@@ -81,6 +141,71 @@ lapic_init()
 	lapicw(TPR, 0);
 }
 
+// Make this CPU's timer interrupt every 'us' microseconds.
+// Does nothing if the timer is already ticking at that rate,
+// so the scheduler may call it freely on every pass.
+void
+lapic_periodic(uint32_t us)
+{
+	if (!lapic)
+		return;
+	cpu *c = cpu_cur();
+	uint32_t ticr = lapic_ticks(us);
+	if (c->timer == (PERIODIC | T_LTIMER) && lapic[TICR] == ticr)
+		return;
+	c->timer = PERIODIC | T_LTIMER;
+	lapicw(TIMER, PERIODIC | T_LTIMER);
+	lapicw(TICR, ticr);
+}
+
+// Interrupt once, 'us' microseconds from now, then stop.
+void
+lapic_oneshot(uint32_t us)
+{
+	if (!lapic)
+		return;
+	cpu_cur()->timer = T_LTIMER;
+	lapicw(TIMER, T_LTIMER);
+	lapicw(TICR, lapic_ticks(us));
+}
+
+// Called on every timer interrupt on this CPU.
+// Once a one-shot has fired, the timer is dead until programmed again:
+// record that as mode 0, so that proc_ready() knows to kick this CPU.
+void
+lapic_timerintr(void)
+{
+	cpu *c = cpu_cur();
+	if (lapic && c->timer == T_LTIMER && lapic[TCCR] == 0)
+		c->timer = 0;
+}
+
+// Send another CPU a timer interrupt, as if its own timer had fired.
+void
+lapic_kick(uint8_t apicid)
+{
+	if (!lapic)
+		return;
+	lapicw(ICRHI, apicid<<24);
+	lapicw(ICRLO, T_LTIMER);	// fixed delivery, edge-triggered
+	while(lapic[ICRLO] & DELIVS)
+		;
+}
+
+// Stop this CPU's timer altogether, e.g., while it has nothing to run.
+void
+lapic_stop(void)
+{
+	if (!lapic)
+		return;
+	cpu *c = cpu_cur();
+	if (c->timer == (MASKED | T_LTIMER))
+		return;
+	c->timer = MASKED | T_LTIMER;
+	lapicw(TIMER, MASKED | T_LTIMER);
+	lapicw(TICR, 0);
+}
+
 // Acknowledge interrupt.
 void
 lapic_eoi(void)
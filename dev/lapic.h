@@ -20,6 +20,17 @@
 // Must be at least 19Hz in order to keep the system type up-to-date.
 #define HZ		25
 
+// Default scheduling quantum in microseconds.
+// Override at build time, e.g., "make DEFS=-DLAPIC_QUANTUM=10000".
+#ifndef LAPIC_QUANTUM
+#define LAPIC_QUANTUM	(1000000/HZ)
+#endif
+
+// Timer ticks per microsecond to assume if calibration fails:
+// this reproduces the historical uncalibrated 10,000,000-tick period.
+#define LAPIC_DEFTPU	(10000000/(1000000/HZ))
+#define LAPIC_DEFTSCPU	1000		// and a 1GHz TSC
+
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID      (0x0020/4)	// ID
@@ -43,7 +54,7 @@
 #define ICRHI   (0x0310/4)	// Interrupt Command [63:32]
 #define TIMER   (0x0320/4)	// Local Vector Table 0 (TIMER)
   #define X1         0x0000000B   // divide counts by 1
-  #define PERIODIC   0x00020000   // Periodic
+  #define PERIODIC   0x00020000   // Periodic (vs one-shot)
 #define PCINT   (0x0340/4)	// Performance Counter LVT
 #define LINT0   (0x0350/4)	// Local Vector Table 1 (LINT0)
 #define LINT1   (0x0360/4)	// Local Vector Table 2 (LINT1)
@@ -58,10 +69,22 @@
 // Initialized in mp.c
 extern volatile uint32_t *lapic;
 
+// Scheduling quantum (microseconds) and calibrated timer and TSC ticks per us.
+extern uint32_t lapic_quantum;
+extern uint32_t lapic_tpu;
+extern uint32_t lapic_tscpu;
+
 
 // Initialize current CPU's local APIC
 void lapic_init(void);
 
+// Program the current CPU's timer: periodic, one-shot, or stopped.
+void lapic_periodic(uint32_t us);
+void lapic_oneshot(uint32_t us);
+void lapic_stop(void);
+void lapic_timerintr(void);	// note a timer interrupt on this CPU
+void lapic_kick(uint8_t apicid);	// send another CPU a timer interrupt
+
 // Acknowledge interrupt
 void lapic_eoi(void);
 
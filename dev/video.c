@@ -46,8 +46,10 @@ video_init(void)
 	blk_pos = pos;
 	line_pos = 1442;
 }
-void
-video_putc(int c)
+// Put one character on the screen without moving the hardware cursor,
+// so that video_write() can move it just once per string.
+static void
+video_putch(int c)
 {
 	int i,temp,temp2;
 	// if no attribute given, then use black on white
@@ -76,11 +78,11 @@ video_putc(int c)
 		line_pos = crt_pos + 2;
 		break;
 	case '\t':
-		video_putc(' ');
-		video_putc(' ');
-		video_putc(' ');
-		video_putc(' ');
-		video_putc(' ');
+		video_putch(' ');
+		video_putch(' ');
+		video_putch(' ');
+		video_putch(' ');
+		video_putch(' ');
 		blk_pos = crt_pos;
 		break;
 	default:
@@ -107,10 +109,26 @@ video_putc(int c)
 		blk_pos = crt_pos;
 		line_pos = crt_pos + 2;
 	}
+}
+
+void
+video_putc(int c)
+{
+	video_putch(c);
+
 	/* move that little blinky thing */
 	set_blk(blk_pos);
 }
 
+// Put 'len' characters all with the attribute 'attr' (in bits 15-8).
+void
+video_write(const char *buf, int len, int attr)
+{
+	while (len-- > 0)
+		video_putch((uint8_t) *buf++ | attr);
+	set_blk(blk_pos);
+}
+
 void blk_left(){
 	if (blk_pos > line_pos){
 		blk_pos--;
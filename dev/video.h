@@ -33,6 +33,7 @@
 
 void video_init(void);
 void video_putc(int c);
+void video_write(const char *buf, int len, int attr);
 
 int delete_chars(int n);
 int video_move_cursor(int n, int del);
@@ -17,6 +17,7 @@
 // The cputs() function is the basic debug-printing function in PIOS.
 // Implemented in kern/console.c (kernel) or lib/cputs.c (user-level code).
 void	cputs(const char *str);
+void	cwrite(const char *buf, size_t len);	// Like cputs with a length
 #define CPUTS_MAX	256	// Max buffer length cputs() will accept
 
 void debug_warn(const char*, int, const char*, ...);
@@ -0,0 +1,45 @@
+/*
+ * Read-only kernel information page, which the kernel maps at VM_KINFO
+ * in every process so programs can learn about their node cheaply.
+ */
+
+#ifndef PIOS_INC_KINFO_H
+#define PIOS_INC_KINFO_H 1
+
+#include <types.h>
+#include <cdefs.h>
+#include <vm.h>
+
+
+#define KINFO_MAXNODES	32		// Same as the kernel's NET_MAXNODES
+
+// The kernel bumps seq to an odd value before updating the fields below
+// and back to even after, so readers retry if seq was odd or changed.
+typedef struct kinfo {
+	volatile uint32_t seq;		// Update sequence number
+	uint32_t	node;		// This node's number, 1-32 (0 if no net)
+	uint32_t	ncpu;		// Number of CPUs on this node
+	uint32_t	tscpu;		// Calibrated TSC ticks per microsecond
+	uint64_t	ticks;		// Timer interrupts so far on the boot CPU
+	uint64_t	tsc;		// TSC when 'time' was last updated
+	uint64_t	time;		// Microseconds since boot as of 'tsc'
+
+	// Processes waiting to run on each node, indexed by node number:
+	// exact for this node, as last heard in migrations for the others.
+	uint32_t	load[KINFO_MAXNODES+1];
+} kinfo;
+
+#define KINFO		((const kinfo *) VM_KINFO)
+
+#ifndef PIOS_KERNEL
+
+int		kinfo_node(void);		// This node's number
+int		kinfo_ncpu(void);		// CPUs on this node
+uint32_t	kinfo_tscpu(void);		// TSC ticks per microsecond
+uint64_t	kinfo_ticks(void);		// Timer interrupts so far
+uint64_t	kinfo_time(void);		// Monotonic microseconds
+uint32_t	kinfo_load(int node);		// Processes waiting on 'node'
+
+#endif	// !PIOS_KERNEL
+
+#endif	// !PIOS_INC_KINFO_H
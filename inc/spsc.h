@@ -0,0 +1,40 @@
+/*
+ * Lock-free single-producer, single-consumer queue of fixed-size slots,
+ * for passing data between a parent and child through memory
+ * they share with SYS_SHARE (see inc/syscall.h).
+ */
+
+#ifndef PIOS_INC_SPSC_H
+#define PIOS_INC_SPSC_H 1
+
+#include <types.h>
+#include <cdefs.h>
+
+
+// The queue header sits at the start of the shared region, with the slots
+// right after it.  Only the consumer writes head and only the producer
+// writes tail, each on its own cache line so the two sides don't collide.
+typedef struct spsc {
+	volatile uint32_t head;		// Count of slots popped so far
+	uint32_t	pad1[15];
+	volatile uint32_t tail;		// Count of slots pushed so far
+	uint32_t	pad2[15];
+	uint32_t	nslots;		// Number of slots: a power of two
+	uint32_t	slotsize;	// Size of each slot in bytes
+	uint32_t	pad3[14];
+	uint8_t		slots[0];
+} spsc;
+
+// Set up a queue of 'slotsize'-byte slots filling 'size' bytes at 'q'.
+// Returns the number of slots, or -1 if not even one fits.
+int	spsc_init(spsc *q, size_t size, size_t slotsize);
+
+// Copy one slot's worth of data into the queue,
+// returning 0 on success or -1 if the queue is full.
+int	spsc_push(spsc *q, const void *data);
+
+// Copy the oldest slot in the queue out to 'data',
+// returning 0 on success or -1 if the queue is empty.
+int	spsc_pop(spsc *q, void *data);
+
+#endif	// !PIOS_INC_SPSC_H
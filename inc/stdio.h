@@ -29,6 +29,7 @@ void	vprintfmt(void (*putch)(int, void*), void *putdat,
 // These are available in both the PIOS kernel and in user space,
 // but are implemented differently in user space and in the kernel.
 void	cputs(const char *str);			// lib/cputs.c or kern/cons.c
+void	cwrite(const char *buf, size_t len);	// lib/cputs.c or kern/cons.c
 int	cprintf(const char *fmt, ...);		// lib/cprintf.c
 int	vcprintf(const char *fmt, va_list);	// lib/cprintf.c
 
@@ -19,8 +19,14 @@
 #define SYS_PUT		0x00000001	// Push data to child and start it
 #define SYS_GET		0x00000002	// Pull results from child
 #define SYS_RET		0x00000003	// Return to parent
+#define SYS_RING	0x00000004	// Run and wait for queued gets/puts
+#define SYS_UPCALL	0x00000005	// Set own page fault upcall handler
 
+#define SYS_LEN		0x00000010	// Cputs: byte count in ECX (below)
 #define SYS_START	0x00000010	// Put: start child running
+#define SYS_FREE	0x00000020	// Put: tear down child (other flags ignored)
+#define SYS_ANY		0x00000040	// Get: from any child in a range (below)
+#define SYS_BATCH	0x00000080	// Get/put: vector of children (below)
 
 #define SYS_REGS	0x00001000	// Get/put register state
 #define SYS_FPU		0x00002000	// Get/put FPU state (with SYS_REGS)
@@ -30,46 +36,236 @@
 #define SYS_ZERO	0x00010000	// Get/put fresh zero-filled memory
 #define SYS_COPY	0x00020000	// Get/put virtual copy
 #define SYS_MERGE	0x00030000	// Get: diffs only from last snapshot
+#define SYS_SYNC	0x00030000	// Put: update a copy, changed pages only
 #define SYS_SNAP	0x00040000	// Put: snapshot child state
+#define SYS_VEC		0x00080000	// Get/put: vector of memory ops (below)
 
 #define SYS_PERM	0x00000100	// Set memory permissions on get/put
 #define SYS_READ	0x00000200	// Read permission (NB: in PTE_AVAIL)
 #define SYS_WRITE	0x00000400	// Write permission (NB: in PTE_AVAIL)
 #define SYS_RW		0x00000600	// Both read and write permission
+#define SYS_SHARE	0x00000800	// Get/put writable shared memory (below)
+
+#define SYS_ADVICE	0x00700000	// Get/put memory advice (below)
+#define SYS_WILLNEED	0x00100000	// Populate writable pages up front
+#define SYS_DONTNEED	0x00200000	// Discard page contents, keep perms
+#define SYS_SEQUENTIAL	0x00400000	// Fault around when written in order
 
 
 // Register conventions for CPUTS system call (write to debug console):
 //	EAX:	System call command
 //	EBX:	User pointer to string to output to debug console,
 //		up to CPUTS_MAX characters long (see inc/assert.h)
+//	ECX:	With SYS_LEN, the number of bytes at EBX to output:
+//		the buffer needn't be NUL-terminated and may be any length
 
 
 // Register conventions on GET/PUT system call entry:
 //	EAX:	System call command/flags (SYS_*)
 //	EDX:	bits 15-8: Node number to migrate to, 0 for current
 //		bits 7-0: Child process number on above node to get/put
+//		bits 23-16: With SYS_ANY, last child number of the range
+//		On return from SYS_ANY: child number chosen, or -1 if none
 //	EBX:	Get/put CPU state pointer for SYS_REGS and/or SYS_FPU)
 //	ECX:	Get/put memory region size
 //	ESI:	Get/put local memory region start
 //	EDI:	Get/put child memory region start
-//	EBP:	reserved
+//	EBP:	With SYS_ANY, user pointer to a bitmap of PROC_CHILDREN bits
+//		naming the children in the range to consider, or 0 for all;
+//		otherwise reserved
+// With SYS_VEC, ESI instead points to an array of ECX sysmemvec entries,
+// at most SYS_VECMAX, each giving its own memory region and its own
+// SYS_MEMOP and SYS_PERM/SYS_RW flags; the kernel performs them in order.
+// Those flags in EAX itself are then ignored.
+// SYS_SHARE, which needs PFF_NONDET, maps the same physical pages writably
+// into both parent and child after any SYS_MEMOP, instead of copying them:
+// writes show up on the other side at once, survive later SYS_COPYs,
+// and SYS_MERGE skips them.  Regions must be page-aligned.
+// SYS_SYNC, like SYS_COPY, needs 4MB-aligned regions and leaves the child's
+// region a copy of ours, but reuses the child's existing page tables
+// and only touches the pages either side has changed since the last
+// SYS_COPY or SYS_SYNC into it: cheap for re-forking a stopped child.
+// SYS_ADVICE flags apply to the destination region after any SYS_MEMOP,
+// SYS_SHARE and SYS_PERM, like madvise(); they too need page alignment.
+// SYS_DONTNEED drops the pages' contents, leaving them zero-filled with
+// their nominal permissions, unlike SYS_ZERO which works in 4MB units.
+// SYS_WILLNEED then gives every nominally writable page in the region
+// its own writable copy at once, instead of one fault per page later.
+// SYS_SEQUENTIAL makes the region the process's one fault-around region:
+// a write fault there also populates the next several pages.
+// A size of zero with SYS_SEQUENTIAL turns fault-around off again.
+
+// Register conventions on GET/PUT system call entry with SYS_BATCH:
+//	EAX:	SYS_GET or SYS_PUT | SYS_BATCH; other flags are ignored
+//	EBX:	User pointer to an array of sysbatch descriptors (below)
+//	ECX:	Number of descriptors, at most PROC_CHILDREN
+//	EDX:	Node number in bits 15-8 as above; bits 7-0 ignored
+// The kernel waits once until every child named in the array has stopped,
+// then performs each descriptor's operation in order in one kernel entry.
+// Each child may appear at most once in the array.
+
+
+// Register conventions for RING system call:
+//	EAX:	System call command
+//	EBX:	Page-aligned user pointer to a sysring (below)
+//	ECX:	Number of completions to wait for
+//	EDX:	Node number in bits 15-8 as for GET/PUT; bits 7-0 ignored
+//		On return: EAX = number of completions in the ring
+// The kernel performs every queued operation whose child is stopped,
+// posting a completion for each, until ECX completions are available
+// or no operation is still waiting for a running child.
+// With PFF_NONDET, operations on different children run in any order
+// as the children stop; otherwise they all run in order.
+
+
+// Register conventions for UPCALL system call:
+//	EAX:	System call command
+//	EBX:	User-level page fault handler entrypoint, or 0 to disable
+//	ECX:	Top of the handler's alternate stack
+//	EDX:	Size of the alternate stack in bytes
+// Instead of reflecting page faults the kernel can't resolve to the parent,
+// the kernel then pushes an upcallframe (below) onto the alternate stack
+// (below the faulting ESP, if the fault happened on that stack already)
+// and resumes the process at the handler with ESP pointing to the frame.
+// The handler resumes the faulting code itself, without a system call,
+// from the registers in the frame (see lib/pfentry.S).
+// If the frame doesn't fit on the stack, the fault goes to the parent.
+// The handler and stack are part of the procstate, so SYS_REGS
+// gets and puts them and they follow the process when it migrates.
 
 
 #ifndef __ASSEMBLER__
 
+// Resource usage of a process, like rusage.
+typedef struct procusage {
+	uint64_t	utime;		// CPU time spent in user mode, in us
+	uint64_t	stime;		// CPU time spent in the kernel, in us
+	uint32_t	nswitch;	// Number of times scheduled onto a CPU
+	uint32_t	nsyscall;	// Number of system calls made
+} procusage;
+
+// Statistics on the gangs a process's children ran in (gang mode only).
+typedef struct procgangstat {
+	uint32_t	count;		// Number of gangs completed
+	uint64_t	makespan;	// Total start-to-last-return time, in us
+	uint64_t	skew;		// Total first-to-last-return time, in us
+} procgangstat;
+
 // Process state save area format for GET/PUT with SYS_REGS flags
 typedef struct procstate {
 	trapframe	tf;		// general registers
 	uint32_t	pff;		// process feature flags - see below
+	uint32_t	weight;		// CPU share weight; on put, 0 = unchanged
+	procusage	ru;		// Usage by this process (get only)
+	procusage	cru;		// Usage by its freed descendants (get only)
+	procgangstat	gang;		// Gangs of its children (get only)
+	uint32_t	pfeip;		// Page fault upcall handler, 0 if none
+	uint32_t	pfstack;	// Top of the upcall's alternate stack
+	uint32_t	pfsize;		// Size of the upcall's alternate stack
 	fxsave		fx;		// x87/MMX/XMM registers
 } procstate;
 
+// Frame the kernel pushes on the alternate stack for a page fault upcall,
+// holding what the handler needs to resume the faulting code.
+typedef struct upcallframe {
+	uint32_t	fva;		// Faulting virtual address, from CR2
+	uint32_t	err;		// Page fault error code (PFE_* in inc/mmu.h)
+	pushregs	regs;		// General registers when the fault occurred
+	uint32_t	eip;		// Faulting instruction
+	uint32_t	eflags;
+	uint32_t	esp;
+} upcallframe;
+
+#ifndef PIOS_KERNEL
+void set_pgfault_handler(void (*handler)(upcallframe *uf)); // lib/pgfault.c
+#endif
+
+// One memory operation in a GET or PUT with SYS_VEC.
+typedef struct sysmemvec {
+	uint32_t	op;		// SYS_MEMOP, SYS_PERM/RW, SYS_ADVICE flags
+	void		*src;		// Source: local on put, child's on get
+	void		*dst;		// Destination: child's on put, local on get
+	size_t		size;		// Region size
+} sysmemvec;
+
+#define SYS_VECMAX	256		// Most entries in one SYS_VEC array
+
+// One child's part of a batched GET or PUT (SYS_BATCH).
+typedef struct sysbatch {
+	uint32_t	flags;		// SYS_* flags, as for a single get/put
+	uint32_t	child;		// Child process number on the current node
+	procstate	*save;		// CPU state pointer for SYS_REGS
+	void		*src;		// Memory region start: local on put
+	void		*dst;		// and child's on get, as for ESI/EDI
+	size_t		size;		// Memory region size
+} sysbatch;
+
+// Submission queue entry for the RING system call:
+// a GET or PUT of one child, as for a SYS_BATCH descriptor.
+typedef struct sysringsqe {
+	uint32_t	op;		// SYS_GET or SYS_PUT | flags; 0 when done
+	uint32_t	child;		// Child process number on the current node
+	procstate	*save;		// CPU state pointer for SYS_REGS
+	void		*src;		// Memory region start: local on put
+	void		*dst;		// and child's on get, as for ESI/EDI
+	size_t		size;		// Memory region size
+	uint32_t	data;		// Caller's tag, returned in the completion
+} sysringsqe;
+
+// Completion queue entry for the RING system call.
+typedef struct sysringcqe {
+	uint32_t	data;		// Tag from the submission
+	int32_t		result;		// 0 if done, -1 if invalid
+} sysringcqe;
+
+#define SYSRING_SQSIZE	64		// Submission queue size
+#define SYSRING_CQSIZE	128		// Completion queue size
+
+// Submission and completion rings, in one page shared with the kernel.
+// The process adds submissions at sqtail and takes completions at cqhead;
+// the kernel takes submissions at sqhead and adds completions at cqtail.
+// Indexes run freely and wrap modulo the queue sizes.
+// Submissions between sqhead and sqtail may already be done (op 0),
+// if ones before them are still waiting for their children.
+typedef struct sysring {
+	volatile uint32_t	sqhead;
+	volatile uint32_t	sqtail;
+	volatile uint32_t	cqhead;
+	volatile uint32_t	cqtail;
+	sysringsqe		sq[SYSRING_SQSIZE];
+	sysringcqe		cq[SYSRING_CQSIZE];
+} sysring;
+
+// Scheduling weights: a process with twice the weight of another
+// gets twice its share of the CPU when both are runnable.
+// New children inherit their parent's weight.
+#define PROC_WEIGHT	1024		// default weight
+#define PROC_MAXWEIGHT	(1024*1024)	// largest weight the kernel accepts
+
 // process feature enable/status flags
 #define PFF_USEFPU	0x0001		// process has used the FPU
 #define PFF_NONDET	0x0100		// enable nondeterministic features
 #define PFF_ICNT	0x0200		// enable instruction count/recovery
 
 
+#ifndef PIOS_KERNEL
+// User programs make system calls with SYSENTER when the processor has it,
+// since it's much faster than INT.  sys_sysenter is 1 if so, 0 if not,
+// and -1 until sys_sysenter_init() (lib/syscall.c) has checked.
+// The kernel's own test code in user mode always uses INT.
+extern int sys_sysenter;
+int sys_sysenter_init(void);
+#define SYS_FAST()	(sys_sysenter > 0 || \
+			 (sys_sysenter < 0 && sys_sysenter_init()))
+
+// Replacement for "int $T_SYSCALL" on the SYSENTER path.
+// The kernel finds our stack pointer in EBP, our return address on the stack,
+// and returns with SYSEXIT, which clobbers ECX and EDX.
+// A restarted system call backs up onto the SYSENTER as it would the INT.
+#define SYS_SYSENTER	"pushl %%ebp; pushl $1f; movl %%esp,%%ebp; " \
+			"sysenter; 1: addl $4,%%esp; popl %%ebp"
+#endif
+
 static void gcc_inline
 sys_cputs(const char *s)
 {
@@ -85,6 +281,17 @@ sys_cputs(const char *s)
 	// potentially change the condition codes and arbitrary
 	// memory locations.
 
+#ifndef PIOS_KERNEL
+	if (SYS_FAST()) {
+		uint32_t c, d;
+		asm volatile(SYS_SYSENTER :
+			  "=c" (c), "=d" (d)
+			: "a" (SYS_CPUTS),
+			  "b" (s)
+			: "cc", "memory");
+		return;
+	}
+#endif
 	asm volatile("int %0" :
 		: "i" (T_SYSCALL),
 		  "a" (SYS_CPUTS),
@@ -92,10 +299,57 @@ sys_cputs(const char *s)
 		: "cc", "memory");
 }
 
+static void gcc_inline
+sys_cwrite(const char *buf, size_t len)
+{
+#ifndef PIOS_KERNEL
+	if (SYS_FAST()) {
+		uint32_t c = len, d;
+		asm volatile(SYS_SYSENTER :
+			  "+c" (c), "=d" (d)
+			: "a" (SYS_CPUTS | SYS_LEN),
+			  "b" (buf)
+			: "cc", "memory");
+		return;
+	}
+#endif
+	asm volatile("int %0" :
+		: "i" (T_SYSCALL),
+		  "a" (SYS_CPUTS | SYS_LEN),
+		  "b" (buf),
+		  "c" (len)
+		: "cc", "memory");
+}
+
+static void gcc_inline
+sys_upcall(void (*handler)(void), void *stacktop, size_t stacksize)
+{
+	asm volatile("int %0" :
+		: "i" (T_SYSCALL),
+		  "a" (SYS_UPCALL),
+		  "b" (handler),
+		  "c" (stacktop),
+		  "d" (stacksize)
+		: "cc", "memory");
+}
+
 static void gcc_inline
 sys_put(uint32_t flags, uint16_t child, procstate *save,
 		void *localsrc, void *childdest, size_t size)
 {
+#ifndef PIOS_KERNEL
+	if (SYS_FAST()) {
+		uint32_t c = size, d = child;
+		asm volatile(SYS_SYSENTER :
+			  "+c" (c), "+d" (d)
+			: "a" (SYS_PUT | flags),
+			  "b" (save),
+			  "S" (localsrc),
+			  "D" (childdest)
+			: "cc", "memory");
+		return;
+	}
+#endif
 	asm volatile("int %0" :
 		: "i" (T_SYSCALL),
 		  "a" (SYS_PUT | flags),
@@ -111,6 +365,19 @@ static void gcc_inline
 sys_get(uint32_t flags, uint16_t child, procstate *save,
 		void *childsrc, void *localdest, size_t size)
 {
+#ifndef PIOS_KERNEL
+	if (SYS_FAST()) {
+		uint32_t c = size, d = child;
+		asm volatile(SYS_SYSENTER :
+			  "+c" (c), "+d" (d)
+			: "a" (SYS_GET | flags),
+			  "b" (save),
+			  "S" (childsrc),
+			  "D" (localdest)
+			: "cc", "memory");
+		return;
+	}
+#endif
 	asm volatile("int %0" :
 		: "i" (T_SYSCALL),
 		  "a" (SYS_GET | flags),
@@ -122,9 +389,132 @@ sys_get(uint32_t flags, uint16_t child, procstate *save,
 		: "cc", "memory");
 }
 
+// Get from whichever child in the range lo..hi stops first,
+// if the caller has PFF_NONDET; otherwise from the lowest-numbered child
+// in the range that is running or has stopped since we last got from it.
+// If 'set' is non-NULL, only children whose bit is set in it count.
+// Returns the child number chosen, or -1 if none has anything to report.
+// This always uses INT, since SYSEXIT can't return a value in EDX.
+// EBP carries 'set', so we save it and load it from the stack around INT,
+// all other registers being taken.
+static int gcc_inline
+sys_getany(uint32_t flags, uint8_t lo, uint8_t hi, const uint32_t *set,
+		procstate *save, void *childsrc, void *localdest, size_t size)
+{
+	int child;
+	asm volatile("pushl %2; pushl %%ebp; movl 4(%%esp),%%ebp; "
+		     "int %1; popl %%ebp; addl $4,%%esp" :
+		  "=d" (child)
+		: "i" (T_SYSCALL),
+		  "m" (set),
+		  "a" (SYS_GET | SYS_ANY | flags),
+		  "b" (save),
+		  "d" (lo | (hi << 16)),
+		  "S" (childsrc),
+		  "D" (localdest),
+		  "c" (size)
+		: "cc", "memory");
+	return child;
+}
+
+// Perform a batch of n gets or puts (type SYS_GET or SYS_PUT)
+// on the children described by the array v, blocking at most once.
+static void gcc_inline
+sys_batch(uint32_t type, sysbatch *v, int n)
+{
+#ifndef PIOS_KERNEL
+	if (SYS_FAST()) {
+		uint32_t c = n, d = 0;
+		asm volatile(SYS_SYSENTER :
+			  "+c" (c), "+d" (d)
+			: "a" (type | SYS_BATCH),
+			  "b" (v)
+			: "cc", "memory");
+		return;
+	}
+#endif
+	asm volatile("int %0" :
+		: "i" (T_SYSCALL),
+		  "a" (type | SYS_BATCH),
+		  "b" (v),
+		  "c" (n),
+		  "d" (0)
+		: "cc", "memory");
+}
+
+// Run the operations queued in ring r,
+// waiting until at least n completions are available.
+// Returns the number of completions available.
+static int gcc_inline
+sys_ring(sysring *r, int n)
+{
+	int avail;
+#ifndef PIOS_KERNEL
+	if (SYS_FAST()) {
+		uint32_t c = n, d = 0;
+		asm volatile(SYS_SYSENTER :
+			  "=a" (avail), "+c" (c), "+d" (d)
+			: "0" (SYS_RING),
+			  "b" (r)
+			: "cc", "memory");
+		return avail;
+	}
+#endif
+	asm volatile("int %1" :
+		  "=a" (avail)
+		: "i" (T_SYSCALL),
+		  "0" (SYS_RING),
+		  "b" (r),
+		  "c" (n),
+		  "d" (0)
+		: "cc", "memory");
+	return avail;
+}
+
+// Queue a get or put on ring r, to run at the next sys_ring().
+// Returns 0, or -1 if the submission queue is full.
+static int gcc_inline
+sys_ringput(sysring *r, uint32_t op, uint32_t child, procstate *save,
+		void *src, void *dst, size_t size, uint32_t data)
+{
+	if (r->sqtail - r->sqhead >= SYSRING_SQSIZE)
+		return -1;
+	sysringsqe *e = &r->sq[r->sqtail % SYSRING_SQSIZE];
+	e->op = op;
+	e->child = child;
+	e->save = save;
+	e->src = src;
+	e->dst = dst;
+	e->size = size;
+	e->data = data;
+	r->sqtail++;
+	return 0;
+}
+
+// Take the next completion from ring r, if any: returns 0 or -1.
+static int gcc_inline
+sys_ringget(sysring *r, sysringcqe *c)
+{
+	if (r->cqhead == r->cqtail)
+		return -1;
+	*c = r->cq[r->cqhead % SYSRING_CQSIZE];
+	r->cqhead++;
+	return 0;
+}
+
 static void gcc_inline
 sys_ret(void)
 {
+#ifndef PIOS_KERNEL
+	if (SYS_FAST()) {
+		uint32_t c, d;
+		asm volatile(SYS_SYSENTER :
+			  "=c" (c), "=d" (d)
+			: "a" (SYS_RET)
+			: "cc", "memory");
+		return;
+	}
+#endif
 	asm volatile("int %0" : :
 		"i" (T_SYSCALL),
 		"a" (SYS_RET));
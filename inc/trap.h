@@ -44,6 +44,11 @@
 // processor defined exceptions or ISA hardware interrupt vectors.
 #define T_SYSCALL	48	// System call
 
+// Error code the SYSENTER entry path stores in its T_SYSCALL trapframes.
+// trap_return uses SYSEXIT instead of IRET to return to such a frame:
+// that clobbers ECX and EDX, which the SYSENTER stubs expect.
+#define SYSENTER_ERR	0x5e
+
 // We use these vectors to receive local per-CPU interrupts
 #define T_LTIMER	49	// Local APIC timer interrupt
 #define T_LERROR	50	// Local APIC error interrupt
@@ -63,6 +63,7 @@ int	fsync(int fn);
 // PIOS-specific thread fork/join functions
 int	tfork(uint16_t child);
 void	tjoin(uint16_t child);
+void	tfree(uint16_t child);
 
 
 #endif	// !PIOS_INC_UNISTD_H
@@ -21,10 +21,15 @@
 //   (It also means we can use at most 1GB of physical memory!)
 //
 // - The next 2.75GB contains the running process's user-level address space.
-//   This is the only address range user-mode processes can access or map.
+//   This is the only address range user-mode processes can map,
+//   and apart from the kernel info page below, the only one they can access.
 //
 // - The top 256MB once again contains direct mappings of physical memory,
 //   giving the kernel access to the high I/O region, e.g., the local APIC.
+//   The exception is its first 4MB slot, at VM_KINFO, which instead maps
+//   just the read-only kernel info page, readable from user mode.
+//   This overrides the identity mapping of physical 0xf0000000-0xf03fffff,
+//   so the kernel can't reach any device registers in that range.
 //
 // Kernel's linear address map: 	              Permissions
 //                                                    kernel/user
@@ -33,8 +38,14 @@
 //                     |                              | RW/--
 //                     |    High 32-bit I/O region    | RW/--
 //                     |                              | RW/--
-//    VM_USERHI -----> +==============================+ 0xf0000000
-//                     |                              | RW/RW
+//                     +------------------------------+ 0xf0400000
+//                     |   (rest of the slot unused)  | --/--
+//                     +------------------------------+ 0xf0001000
+//                     |  Kernel info page (1 page)   | R-/R-
+//    VM_KINFO ------> +==============================+ 0xf0000000
+//    (= VM_USERHI,    |                              | RW/RW
+//     the top of the  |                              | RW/RW
+//     user area)      |                              | RW/RW
 //                     |~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~|
 //                     :              .               :
 //                     :              .               :
@@ -58,6 +69,12 @@
 #define	VM_USERHI	0xf0000000
 #define	VM_USERLO	0x40000000
 
+// Read-only kernel information page visible to every process
+// (see inc/kinfo.h), in its own 4MB slot just above the user area,
+// so that user-space memory operations, which stop at VM_USERHI,
+// never disturb it.  The slot is taken from the high I/O region (above).
+#define VM_KINFO	0xf0000000
+
 
 //
 // Within the user-space region, user processes are technically free
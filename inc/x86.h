@@ -47,6 +47,14 @@ typedef struct cpuinfo {
 	uint32_t	ecx;
 } cpuinfo;
 
+// CPUID function 1 feature flags we use
+#define CPUID_EDX_SEP	0x00000800	// SYSENTER/SYSEXIT supported
+
+// Model-specific registers
+#define MSR_SYSENTER_CS		0x174	// Kernel code segment for SYSENTER
+#define MSR_SYSENTER_ESP	0x175	// Kernel stack pointer for SYSENTER
+#define MSR_SYSENTER_EIP	0x176	// Kernel entrypoint for SYSENTER
+
 
 
 static gcc_inline void
@@ -189,6 +197,12 @@ rcr0(void)
 	return val;
 }
 
+static gcc_inline void
+clts(void)
+{
+	__asm __volatile("clts");
+}
+
 static gcc_inline uint32_t
 rcr2(void)
 {
@@ -333,6 +347,33 @@ cpuid(uint32_t idx, cpuinfo *info)
 		: "a" (idx));
 }
 
+// Returns true if the processor really supports SYSENTER/SYSEXIT:
+// the original Pentium Pro reports SEP but doesn't implement it.
+static gcc_inline bool
+hassysenter(void)
+{
+	cpuinfo inf;
+	cpuid(1, &inf);
+	int family = (inf.eax >> 8) & 0xf, model = (inf.eax >> 4) & 0xf;
+	if (family == 6 && model < 3 && (inf.eax & 0xf) < 3)
+		return 0;
+	return (inf.edx & CPUID_EDX_SEP) != 0;
+}
+
+static gcc_inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	asm volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+static gcc_inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
 static gcc_inline uint64_t
 rdtsc(void)
 {
@@ -562,9 +562,36 @@ cputs(const char *str)
 	if (!already)
 		spinlock_acquire(&cons_lock);
 
-	char ch;
-	while (*str)
-		cons_putc(*str++);
+	cwrite(str, strlen(str));
+
+	if (!already)
+		spinlock_release(&cons_lock);
+}
+
+// Write 'len' bytes to the console, which needn't be NUL-terminated,
+// taking the console spinlock just once for the whole buffer
+// and handing each run between color escapes to the video driver at once.
+void
+cwrite(const char *buf, size_t len)
+{
+	if (read_cs() & 3)
+		return sys_cwrite(buf, len);	// use syscall from user mode
+
+	bool already = spinlock_holding(&cons_lock);
+	if (!already)
+		spinlock_acquire(&cons_lock);
+
+	const char *end = buf + len;
+	while (buf < end) {
+		if (esc_flag > 0 || *buf == 27) {
+			cons_putc(*buf++);
+			continue;
+		}
+		const char *run = buf;
+		while (buf < end && *buf != 27)
+			serial_putc(*buf++);
+		video_write(run, buf - run, color_mask);
+	}
 
 	if (!already)
 		spinlock_release(&cons_lock);
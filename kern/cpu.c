@@ -27,7 +27,8 @@ cpu cpu_boot = {
 	// To load the SS register, the CPL must equal the DPL.  Thus,
 	// we must duplicate the segments for the user and the kernel.
 	//
-	// The only descriptor that differs across CPUs is the TSS descriptor.
+	// The only descriptors that differ across CPUs are the TSS descriptor
+	// and the per-CPU data segment, which cpu_init() fills in.
 	//
 	gdt: {
 		// 0x0 - unused (always faults: for trapping NULL far pointers)
@@ -56,7 +57,9 @@ cpu cpu_boot = {
 
 void cpu_init()
 {
-	cpu *c = cpu_cur();
+	cpu *c = cpu_stack();
+	assert(c->magic == CPU_MAGIC);
+	c->self = c;
 	
 	// Setup TSS
 	taskstate ts;
@@ -68,13 +71,17 @@ void cpu_init()
 	c->gdt[CPU_GDT_TSS >> 3] = SEGDESC16(0, STS_T32A, (uint32_t) &c->tss,
 					sizeof(taskstate), 0);
 
+	// Setup per-CPU data segment covering just this cpu struct
+	c->gdt[CPU_GDT_KCPU >> 3] = SEGDESC32(1, STA_W, (uint32_t) c,
+					PAGESIZE - 1, 0);
+
 	// Load the GDT
 	struct pseudodesc gdt_pd = {
 		sizeof(c->gdt) - 1, (uint32_t) c->gdt };
 	asm volatile("lgdt %0" : : "m" (gdt_pd));	
 
 	// Reload all segment registers.
-	asm volatile("movw %%ax,%%gs" :: "a" (CPU_GDT_UDATA|3));
+	asm volatile("movw %%ax,%%gs" :: "a" (CPU_GDT_KCPU));
 	asm volatile("movw %%ax,%%fs" :: "a" (CPU_GDT_UDATA|3));
 	asm volatile("movw %%ax,%%es" :: "a" (CPU_GDT_KDATA));
 	asm volatile("movw %%ax,%%ds" :: "a" (CPU_GDT_KDATA));
@@ -86,6 +93,17 @@ void cpu_init()
 	
 	// Load the TSS
 	ltr(CPU_GDT_TSS);
+
+	// Set up the SYSENTER fast system call path (see kern/trapasm.S):
+	// it enters the kernel on the same stack as traps from user mode.
+	// SYSENTER and SYSEXIT derive the other segments from the code
+	// segment, which our GDT layout above is arranged to match.
+	if (hassysenter()) {
+		extern char sysenter_entry[];
+		wrmsr(MSR_SYSENTER_CS, CPU_GDT_KCODE);
+		wrmsr(MSR_SYSENTER_ESP, (uint32_t) &c->kstackhi);
+		wrmsr(MSR_SYSENTER_EIP, (uint32_t) sysenter_entry);
+	}
 }
 
 // Allocate an additional cpu struct representing a non-bootstrap processor.
@@ -21,7 +21,8 @@
 #define CPU_GDT_UDATA	0x20	// user data
 #define CPU_GDT_UDTLS	0x28	// user thread local storage data segment
 #define CPU_GDT_TSS	0x30	// task state segment
-#define CPU_GDT_NDESC	7	// number of GDT entries used, including null
+#define CPU_GDT_KCPU	0x38	// kernel per-CPU data segment, kept in %gs
+#define CPU_GDT_NDESC	8	// number of GDT entries used, including null
 
 
 #ifndef __ASSEMBLER__
@@ -42,6 +43,10 @@ typedef struct cpu {
 	// but it's easier just to have a separate fixed-size GDT per CPU.
 	segdesc		gdt[CPU_GDT_NDESC];
 
+	// Pointer to this very struct, which the CPU_GDT_KCPU segment
+	// in %gs lets the kernel find in one instruction (see cpu_cur()).
+	struct cpu	*self;
+
 	// Each CPU needs its own TSS,
 	// because when the processor switches from lower to higher privilege,
 	// it loads a new stack pointer (ESP) and stack segment (SS)
@@ -64,6 +69,23 @@ typedef struct cpu {
 	// Process currently running on this CPU.
 	struct proc	*proc;
 
+	// LAPIC timer mode last programmed on this CPU (dev/lapic.c),
+	// or 0 once a one-shot has fired and the timer is dead.
+	uint32_t	timer;
+
+	// Set when a user single-stepped into SYSENTER (see trap()),
+	// so syscall() gives the process its trap flag back.
+	bool		sysstep;
+
+	// Process whose state this CPU's FPU registers hold, if any.
+	// Only valid if that process's fpucpu still points back to us.
+	struct proc	*fpu;
+
+	// Pool of clean page directories ready for pmap_newpdir(),
+	// chained through their pageinfo free_next links (see pmap.c).
+	struct pageinfo	*pdirpool;
+	int		npdirpool;
+
 	// Magic verification tag (CPU_MAGIC) to help detect corruption,
 	// e.g., if the CPU's ring 0 stack overflows down onto the cpu struct.
 	uint32_t	magic;
@@ -84,12 +106,37 @@ extern cpu cpu_boot;
 
 #define cpu_disabled(c)		0
 
+// Find the CPU struct from the stack pointer:
+// it always resides at the bottom of the page containing the CPU's stack.
+// Only cpu_init() needs this, before it loads %gs for cpu_cur() below.
+static inline cpu *
+cpu_stack() {
+	return (cpu*)ROUNDDOWN(read_esp(), PAGESIZE);
+}
+
+// Read or write a 32-bit field of the current CPU's struct in one instruction,
+// through the per-CPU data segment that cpu_init() leaves in %gs
+// and that every entry into the kernel reloads (see kern/trapasm.S).
+#define cpu_get(field) ({ \
+	typeof(((cpu*)0)->field) __v; \
+	asm volatile("movl %%gs:%c1,%0" \
+		: "=r" (__v) : "i" (offsetof(cpu, field)) : "memory"); \
+	__v; })
+#define cpu_set(field, val) ({ \
+	typeof(((cpu*)0)->field) __v = (val); \
+	asm volatile("movl %0,%%gs:%c1" \
+		: : "r" (__v), "i" (offsetof(cpu, field)) : "memory"); })
+
 // Find the CPU struct representing the current CPU.
-// It always resides at the bottom of the page containing the CPU's stack.
+// Build with DEFS=-DCPU_DEBUG to check the magic tag on every call,
+// e.g., to catch the CPU's ring 0 stack overflowing onto the cpu struct.
 static inline cpu *
 cpu_cur() {
-	cpu *c = (cpu*)ROUNDDOWN(read_esp(), PAGESIZE);
+	cpu *c;
+	asm("movl %%gs:%c1,%0" : "=r" (c) : "i" (offsetof(cpu, self)));
+#ifdef CPU_DEBUG
 	assert(c->magic == CPU_MAGIC);
+#endif
 	return c;
 }
 
@@ -68,7 +68,7 @@ file_initroot(proc *root)
 
 	// Make sure the root process's page directory is loaded,
 	// so that we can write into the root process's file area directly.
-	cpu_cur()->proc = root;
+	cpu_set(proc, root);
 	lcr3(mem_phys(root->pdir));
 
 	// Enable read/write access on the file metadata area
@@ -181,7 +181,7 @@ file_wakeroot(void)
 {
 	spinlock_acquire(&file_lock);
 	if (proc_root && proc_root->state == PROC_STOP)
-		proc_ready(proc_root);
+		proc_wake(proc_root);
 	spinlock_release(&file_lock);
 }
 
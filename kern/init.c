@@ -26,6 +26,7 @@
 #include <kern/proc.h>
 #include <kern/file.h>
 #include <kern/net.h>
+#include <kern/kinfo.h>
 
 #include <dev/pic.h>
 #include <dev/lapic.h>
@@ -49,7 +50,11 @@ init(void)
 {
 	extern char start[], edata[], end[];
 
-	// Before anything else, complete the ELF loading process.
+	// Load this CPU's GDT, TSS, and per-CPU data segment first,
+	// since cpu_cur() and everything that uses it depend on the latter.
+	cpu_init();
+
+	// Next, complete the ELF loading process.
 	// Clear all uninitialized global data (BSS) in our program,
 	// ensuring that all static/global variables start out zero.
 	if (cpu_onboot())
@@ -60,8 +65,7 @@ init(void)
 	cons_init();
 	debug_check();
 	
-	// Initialize and load the bootstrap CPU's GDT, TSS, and IDT.
-	cpu_init();
+	// Initialize and load the IDT.
 	trap_init();
 	
 	trap_check_kernel();
@@ -98,6 +102,7 @@ init(void)
 	file_init();		// Create root directory and console I/O files
 	pci_init();		// Initialize the PCI bus and network card
 	net_init();		
+	kinfo_tick();		// Fill in the kernel info page
 
 	// Lab 4: uncomment this when you can handle IRQ_SERIAL and IRQ_KBD.
 	cons_intenable();	// Let the console start producing interrupts
@@ -0,0 +1,58 @@
+/*
+ * Read-only kernel information page mapped into every process.
+ */
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+
+#include <kern/cpu.h>
+#include <kern/mp.h>
+#include <kern/proc.h>
+#include <kern/pmap.h>
+#include <kern/net.h>
+#include <kern/kinfo.h>
+
+#include <dev/lapic.h>
+
+
+kinfo gcc_aligned(PAGESIZE) kinfo_page;
+
+// Page table for the 4MB slot at VM_KINFO, mapping just the info page.
+static pte_t gcc_aligned(PAGESIZE) kinfo_ptab[NPTENTRIES];
+
+void
+kinfo_init(void)
+{
+	assert(sizeof(kinfo) <= PAGESIZE);
+	assert(KINFO_MAXNODES == NET_MAXNODES);
+	assert(PTOFF(VM_KINFO) == 0);
+
+	// The kernel updates the page through its own direct mapping;
+	// processes get a read-only user mapping of it.
+	// This replaces the boot pdir's identity mapping of the first 4MB
+	// of the high I/O region (see inc/vm.h).
+	kinfo_ptab[0] = mem_phys(&kinfo_page) | PTE_P | PTE_U | PTE_G;
+	pmap_bootpdir[PDX(VM_KINFO)] = mem_phys(kinfo_ptab) | PTE_P | PTE_U;
+}
+
+void
+kinfo_tick(void)
+{
+	if (!cpu_onboot())
+		return;		// count only one CPU's ticks
+
+	kinfo *k = &kinfo_page;
+	k->seq++;
+	asm volatile("" : : : "memory");
+
+	k->node = net_node;
+	k->ncpu = ncpu;
+	k->tscpu = lapic_tscpu;
+	k->ticks++;
+	k->tsc = rdtsc();
+	k->time = k->tsc / lapic_tscpu;
+	k->load[net_node] = proc_nready;
+
+	asm volatile("" : : : "memory");
+	k->seq++;
+}
@@ -0,0 +1,23 @@
+/*
+ * Kernel side of the read-only kernel information page (see inc/kinfo.h).
+ */
+
+#ifndef PIOS_KERN_KINFO_H
+#define PIOS_KERN_KINFO_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/kinfo.h>
+
+
+extern kinfo kinfo_page;
+
+// Map the info page into pmap_bootpdir, and thus into every pdir cloned
+// from it, before the first process is created.  Called from pmap_init().
+void kinfo_init(void);
+
+// Refresh the info page.  Called on every timer interrupt.
+void kinfo_tick(void);
+
+#endif /* !PIOS_KERN_KINFO_H */
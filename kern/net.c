@@ -14,31 +14,42 @@
 #include <kern/trap.h>
 #include <kern/proc.h>
 #include <kern/net.h>
+#include <kern/kinfo.h>
 
 #include <dev/e100.h>
+#include <dev/lapic.h>
 
 
 uint8_t net_node;	// My node number - from net_mac[5]
 uint8_t net_mac[6];	// My MAC address from the Ethernet card
 
 spinlock net_lock;
+spinlock net_enclock;	// Protects the pull reply encoding buffers
 proc *net_migrlist;	// List of currently migrating processes
 proc *net_pulllist;	// List of processes currently pulling a page
 
 #define NET_ETHERTYPE	0x9876	// Claim this ethertype for our packets
 
+// Retransmit interval in microseconds: 64 ticks at the historical HZ.
+#define NET_RETRANSMIT	(64 * (1000000/HZ))
+
 
 void net_txmigrq(proc *p);
 void net_rxmigrq(net_migrq *migrq);
 void net_txmigrp(uint8_t dstnode, uint32_t prochome);
 void net_rxmigrp(net_migrp *migrp);
 
-void net_pull(proc *p, uint32_t rr, void *pg, int pglevel);
-void net_txpullrq(proc *p);
+net_pullslot *net_pull(proc *p, uint32_t rr, void *pg, int pglevel);
+void net_pullsend(proc *p);
+void net_pullwait(proc *p, net_pullslot *ps);
+void net_txpullrq(proc *p, bool all);
 void net_rxpullrq(net_pullrq *rq);
-void net_txpullrp(uint8_t rqnode, uint32_t rr, int pglev, int part, void *pg);
+void net_rxpullrg(net_pullrg *rg, int len);
+void net_txpullrp(uint8_t rqnode, uint32_t rr, int pglev, int need, void *pg);
 void net_rxpullrp(net_pullrphdr *rp, int len);
-bool net_pullpte(proc *p, uint32_t *pte, int pglevel);
+bool net_pullpte(trapframe *tf, int entry, uint32_t *pte, int pglevel,
+		int ahead);
+static uint32_t net_rrconv(uint32_t pte, int pglev, uint8_t dstnode);
 
 void
 net_init(void)
@@ -47,6 +58,7 @@ net_init(void)
 		return;
 
 	spinlock_init(&net_lock);
+	spinlock_init(&net_enclock);
 
 	if (!e100_present) {
 		cprintf("No network card found; networking disabled\n");
@@ -118,22 +130,42 @@ net_rx(void *pkt, int len)
 	else if (h->type == NET_PULLRP){
 		net_rxpullrp(pkt, len);
 	}
+	else if (h->type == NET_PULLRG){
+		net_rxpullrg(pkt, len);
+	}
 
 	// Lab 5: your code here to process received messages.
 	// warn("net_rx: received a message; now what?");
 }
 
+// Returns true if any migrations or page pulls are awaiting replies,
+// in which case the boot CPU must keep its timer running for net_tick().
+// Deliberately unlocked: a stale answer only delays the next check.
+bool
+net_pending(void)
+{
+	return net_migrlist != NULL || net_pulllist != NULL;
+}
+
 // Called by trap() on every timer interrupt,
 // so that we can periodically retransmit lost packets.
+// We measure the real time elapsed with the calibrated TSC,
+// since timer interrupts come at varying intervals
+// (e.g., gang members' one-shots for the rest of a shared slice),
+// so the retransmit interval depends neither on those nor on the host.
 void
 net_tick()
 {
 	if (!cpu_onboot())
 		return;		// count only one CPU's ticks
 
-	static int tick;
-	if (++tick & 63)
+	static uint64_t last;
+	uint64_t now = rdtsc();
+	if (last == 0)
+		last = now;
+	if (now - last < (uint64_t)NET_RETRANSMIT * lapic_tscpu)
 		return;
+	last = now;
 
 	spinlock_acquire(&net_lock);
 
@@ -144,10 +176,10 @@ net_tick()
 		cur = cur->migrnext;
 	}
 
-	//ticking to call net_rxpullrq
+	// Retransmit every pull still in flight, blocking a process or not.
 	proc *npull = net_pulllist;
 	while(npull){
-		net_txpullrq(npull);
+		net_txpullrq(npull, 1);
 		npull = npull->pullnext;
 	}
 
@@ -177,6 +209,8 @@ net_migrate(trapframe *tf, uint8_t dstnode, int entry)
 {
 	proc *p = proc_cur();
 	proc_save(p, tf, entry);	// save current process's state
+	proc_fpusave(p);		// FPU state must travel with it
+	proc_getusage(p);		// and so must its CPU usage
 
 	assert(dstnode > 0 && dstnode <= NET_MAXNODES && dstnode != net_node);
 	//cprintf("proc %x at eip %x migrating to node %d\n",
@@ -230,7 +264,24 @@ net_txmigrq(proc *p)
 	r.type = NET_MIGRQ;
 	r.home = p->home;
 	r.pdir = RRCONS(net_node, mem_phys(p->pdir), 0);
+	r.load = proc_nready;
 	r.save = p->sv;
+
+	// List the regions the proc changed while away from home,
+	// sharing their page tables with the destination, if they fit.
+	r.ndirty = 0;
+	int i;
+	for (i = PDX(VM_USERLO); i < PDX(VM_USERHI); i++) {
+		if (!(p->dirty[i/32] & (1 << (i%32))))
+			continue;
+		if (r.ndirty == NET_MIGRDIRTY) {
+			r.ndirty = NET_DIRTYALL;
+			break;
+		}
+		r.dirtyidx[r.ndirty] = i;
+		r.dirtyrr[r.ndirty++] = net_rrconv(p->pdir[i], PGLEV_PDIR,
+						p->migrdest);
+	}
 	
 	net_tx(&r, sizeof(net_migrq), NULL, 0);
 }
@@ -241,6 +292,7 @@ void net_rxmigrq(net_migrq *migrq)
 	//cprintf("rxmigrq\n");
 	uint8_t srcnode = migrq->eth.src[5];
 	assert(srcnode > 0 && srcnode <= NET_MAXNODES);
+	kinfo_page.load[srcnode] = migrq->load;
 
 	// Do we already have a local proc corresponding to the remote one?
 	proc *p = NULL;
@@ -267,22 +319,63 @@ void net_rxmigrq(net_migrq *migrq)
 
 	// Copy the CPU state and pdir RR into our proc struct
 	p->sv = migrq->save;
+	p->fpucpu = NULL;	// any FPU state cached here is now stale
+	p->fpudirty = 0;
+	proc_setusage(p);
 	p->rrpdir = migrq->pdir;
-	p->pullva = VM_USERLO;	// pull all user space from USERLO to USERHI
 
 	// Acknowledge the migration request so the source node stops resending
 	net_txmigrp(srcnode, p->home);
 
-	// Free the proc's old page directory and allocate a fresh one.
-	// (The old pdir will hang around until all shared copies disappear.)
+	// A proc returning home can keep its old page tables
+	// for the regions it didn't change while it was away,
+	// and pull only the others on demand (see net_fetch).
+	int i;
+	bool all = migrq->ndirty == NET_DIRTYALL
+			|| migrq->ndirty > NET_MIGRDIRTY;
+	memset(p->dirty, 0, sizeof(p->dirty));
+	if (RRNODE(p->home) == net_node && !all) {
+		for (i = 0; i < migrq->ndirty; i++) {
+			int pdx = migrq->dirtyidx[i];
+			if (pdx < PDX(VM_USERLO) || pdx >= PDX(VM_USERHI))
+				continue;
+			pmap_remove(p->pdir, pdx << PDXSHIFT, PTSIZE);
+			p->pdir[pdx] = migrq->dirtyrr[i];
+		}
+		// The pages it left behind writable may since have been
+		// named to other nodes, e.g., to a child forked while away:
+		// they must not change under those nodes' references.
+		pmap_cowshared(p->pdir, VM_USERLO, VM_USERHI - VM_USERLO);
+		proc_ready(p);
+		return;
+	}
+
+	// Otherwise remember what changed since the proc left home,
+	// to tell the next node it migrates to.
+	if (RRNODE(p->home) != net_node && all)
+		memset(p->dirty, 0xff, sizeof(p->dirty));
+	else if (RRNODE(p->home) != net_node)
+		for (i = 0; i < migrq->ndirty; i++) {
+			int pdx = migrq->dirtyidx[i] % NPDENTRIES;
+			p->dirty[pdx/32] |= 1 << (pdx%32);
+		}
+
+	// Drop the proc's old page directory and allocate a fresh one.
+	// Any table or page in it that we ever named to another node
+	// was marked shared by net_rrconv(), so mem_decref() leaves it
+	// (and everything it maps) in place for RRs still naming it;
+	// only what no other node can name gets freed here.
 	mem_decref(mem_ptr2pi(p->pdir), pmap_freepdir);
 	p->pdir = pmap_newpdir();	assert(p->pdir);
 
 	// Now we need to pull over the page directory next,
 	// before we can do anything else.
 	// Just pull it straight into our proc's page directory;
+	// everything else it maps gets pulled on demand once it runs.
 	// XXX first free old contents of pdir
-	net_pull(p, p->rrpdir, p->pdir, PGLEV_PDIR);
+	net_pullslot *ps = net_pull(p, p->rrpdir, p->pdir, PGLEV_PDIR);
+	net_pullsend(p);
+	net_pullwait(p, ps);
 }
 
 // Transmit a migration reply to a given node, for a given proc's home RR
@@ -296,6 +389,7 @@ net_txmigrp(uint8_t dstnode, uint32_t prochome)
 	
 	r.type = NET_MIGRP;
 	r.home = prochome;
+	r.load = proc_nready;
 	
 	net_tx(&r, sizeof(net_migrp), NULL, 0);
 }
@@ -306,6 +400,7 @@ void net_rxmigrp(net_migrp *migrp)
 	//cprintf("rxmigrp\n");
 	uint8_t msgsrcnode = migrp->eth.src[5];
 	assert(msgsrcnode > 0 && msgsrcnode <= NET_MAXNODES);
+	kinfo_page.load[msgsrcnode] = migrp->load;
 
 	// Lab 5: insert code to process a migrate reply message.
 	// Look for the appropriate migrating proc in the migrlist,
@@ -341,8 +436,25 @@ void net_rxmigrp(net_migrp *migrp)
 	spinlock_release(&cur->lock);
 }
 
-// Pull a page via a remote ref and put process p to sleep waiting for it.
+// Note that the mappings of 'size' bytes at 'va' for process p changed.
+// While a proc is away from home we keep track of the regions it changed,
+// so that it can keep its old page tables for the rest when it returns.
 void
+net_dirty(proc *p, uint32_t va, size_t size)
+{
+	if (RRNODE(p->home) == net_node || size == 0)
+		return;
+	uint32_t i, end = PDX(va + size - 1);
+	for (i = PDX(va); i <= end; i++)
+		p->dirty[i/32] |= 1 << (i%32);
+}
+
+// Start pulling a page via a remote ref on behalf of process p,
+// in a free slot of its pull window, and return that slot.
+// The request goes out with the next net_pullsend() for the process,
+// together with any others started in the meantime;
+// the process keeps running until it needs the page (see net_pullwait).
+net_pullslot *
 net_pull(proc *p, uint32_t rr, void *pg, int pglevel)
 {
 	//cprintf("net_pull: proc %x rr %x -> %x level %d\n",
@@ -351,78 +463,126 @@ net_pull(proc *p, uint32_t rr, void *pg, int pglevel)
 	assert(dstnode > 0 && dstnode <= NET_MAXNODES);
 	assert(dstnode != net_node);
 	assert(pglevel >= 0 && pglevel <= 2);
-	
-	// Lab 5: insert code here to put the process into the PROC_PULL state,
-	// save in the proc structure all information needed for the pull,
-	// and transmit a pull message using net_txpullrq().
+
+	spinlock_acquire(&net_lock);
+	net_pullslot *ps = p->pull;
+	while (ps->rr != 0) {
+		ps++;
+		assert(ps < &p->pull[NET_PULLWIN]);	// window is full
+	}
+	ps->rr = rr;
+	ps->pg = pg;
+	ps->pglev = pglevel;
+	ps->arrived = 0;
+	ps->unsent = 1;
+
+	// Put the proc on the list of pulling procs with its first pull.
+	if (p->npull++ == 0) {
+		p->pullnext = NULL;
+		proc **pp = &net_pulllist;
+		while (*pp)
+			pp = &(*pp)->pullnext;
+		*pp = p;
+	}
+	spinlock_release(&net_lock);
+	return ps;
+}
+
+// Send the requests for the pulls process p has started since the last call.
+void
+net_pullsend(proc *p)
+{
+	spinlock_acquire(&net_lock);
+	net_txpullrq(p, 0);
+	spinlock_release(&net_lock);
+}
+
+// Put process p, which has been saved with proc_save(),
+// into the PROC_PULL state until the pull in slot 'ps' completes.
+// The caller must then give up the CPU as usual.
+void
+net_pullwait(proc *p, net_pullslot *ps)
+{
 	spinlock_acquire(&p->lock);
 	p->state = PROC_PULL;
-	p->pullpg = pg;
-	p->pullrr = rr;
-	p->pglev = pglevel;
-	p->arrived = 0;
-	p->pullnext = NULL;
 	spinlock_release(&p->lock);
-	
+
+	// The pull may already have completed, in which case we're done.
 	spinlock_acquire(&net_lock);
-	if (net_pulllist) {
-		proc* last = net_pulllist;
-		while(last->pullnext) {
-			last = last->pullnext;
-		}
-		last->pullnext = p;
-	}	
-	else net_pulllist = p; 
-	
-	net_txpullrq(p);
+	bool done = ps->rr == 0;
+	if (!done)
+		p->pullwait = ps;
 	spinlock_release(&net_lock);
+
+	if (done)
+		proc_ready(p);
 }
 
-// Transmit a page pull request on behalf of some process.
+// Transmit range pull requests for process p's unsent pulls,
+// or for all its pulls in flight if 'all' (to retransmit them),
+// grouping them by node into as few requests as we can.
 void
-net_txpullrq(proc *p)
+net_txpullrq(proc *p, bool all)
 {
 	//cprintf("txpullrq\n");
-	assert(p->state == PROC_PULL);
 	assert(spinlock_holding(&net_lock));
-	
-	// Lab 5: transmit or retransmit a pull request (net_pullrq).
-	net_pullrq r;
-	net_ethsetup(&r.eth, RRNODE(p->pullrr));
-	r.type = NET_PULLRQ;
-	r.rr = p->pullrr;
-	r.pglev = p->pglev;
-	r.need = ~ p->arrived & 7;
-	net_tx(&r, sizeof(net_pullrq), NULL, 0);
+
+	bool send[NET_PULLWIN];
+	int i, j;
+	for (i = 0; i < NET_PULLWIN; i++)
+		send[i] = p->pull[i].rr != 0 && (all || p->pull[i].unsent);
+
+	for (i = 0; i < NET_PULLWIN; i++) {
+		if (!send[i])
+			continue;
+
+		// Gather the pulls from the same node at the same level.
+		net_pullrg r;
+		uint8_t node = RRNODE(p->pull[i].rr);
+		net_ethsetup(&r.eth, node);
+		r.type = NET_PULLRG;
+		r.pglev = p->pull[i].pglev;
+		r.count = 0;
+		memset(r.need, 0, sizeof(r.need));
+		for (j = i; j < NET_PULLWIN && r.count < NET_PULLRANGE; j++) {
+			net_pullslot *ps = &p->pull[j];
+			if (!send[j] || RRNODE(ps->rr) != node
+					|| ps->pglev != r.pglev)
+				continue;
+			int part;
+			for (part = 0; part < 3; part++)
+				if (!(ps->arrived & (1 << part)))
+					r.need[part] |= 1 << r.count;
+			r.rr[r.count++] = ps->rr;
+			ps->unsent = 0;
+			send[j] = 0;
+		}
+		net_tx(&r, sizeof(net_pullrg), NULL, 0);
+	}
 }
 
-// Process a page pull request we've received.
-void
-net_rxpullrq(net_pullrq *rq)
+// Send node 'rqnode' the parts of the page 'rr' names that it 'need's,
+// as requested by a pull or range pull.
+static void
+net_pullserve(uint8_t rqnode, uint32_t rr, int pglev, int need)
 {
-	//cprintf("rxpullrq\n");
-	assert(rq->type == NET_PULLRQ);
-	uint8_t rqnode = rq->eth.src[5];
-	assert(rqnode > 0 && rqnode <= NET_MAXNODES && rqnode != net_node);
-
 	// Validate the requested node number and page address.
-	uint32_t rr = rq->rr;
 	if (RRNODE(rr) != net_node) {
-		warn("net_rxpullrq: pull request came to wrong node!?");
+		warn("net_pullserve: pull request came to wrong node!?");
 		return;
 	}
 	uint32_t addr = RRADDR(rr);
 	pageinfo *pi = mem_phys2pi(addr);
 	if (pi <= &mem_pageinfo[0] || pi >= &mem_pageinfo[mem_npage]) {
-		warn("net_rxpullrq: pull request for invalid page %x", addr);
+		warn("net_pullserve: pull request for invalid page %x", addr);
 		return;
 	}
 	if (pi->refcount == 0) {
-		warn("net_rxpullrq: pull request for free page %x", addr);
+		warn("net_pullserve: pull request for free page %x", addr);
 		return;
 	}
 	if (pi->home != 0 && 0) {
-		warn("net_rxpullrq: pull request for unowned page %x", addr);
+		warn("net_pullserve: pull request for unowned page %x", addr);
 		return;
 	}
 	void *pg = mem_pi2ptr(pi);
@@ -432,11 +592,7 @@ net_rxpullrq(net_pullrq *rq)
 	net_rrshare(pg, rqnode);
 
 	// Send back whichever of the three page parts the caller still needs.
-	// (We must divide the page into parts to fit into Ethernet packets.)
-	// Lab 5: use net_txpullrp() to send the appropriate parts of the page.
-	if (rq->need & 1) net_txpullrp(rqnode, rr, rq->pglev, 0, pg);
-	if (rq->need & 2) net_txpullrp(rqnode, rr, rq->pglev, 1, pg);
-	if (rq->need & 3) net_txpullrp(rqnode, rr, rq->pglev, 2, pg);
+	net_txpullrp(rqnode, rr, pglev, need, pg);
 	
 	// Mark this page shared with the requesting node.
 	// (XXX might be necessarily only for pdir/ptab pages.)
@@ -444,162 +600,525 @@ net_rxpullrq(net_pullrq *rq)
 	pi->shared |= 1 << (rqnode-1);
 }
 
+// Process a page pull request we've received.
+void
+net_rxpullrq(net_pullrq *rq)
+{
+	//cprintf("rxpullrq\n");
+	assert(rq->type == NET_PULLRQ);
+	uint8_t rqnode = rq->eth.src[5];
+	assert(rqnode > 0 && rqnode <= NET_MAXNODES && rqnode != net_node);
+
+	net_pullserve(rqnode, rq->rr, rq->pglev, rq->need);
+}
+
+// Process a range pull request we've received,
+// streaming back all the parts it asks for.
+void
+net_rxpullrg(net_pullrg *rg, int len)
+{
+	assert(rg->type == NET_PULLRG);
+	uint8_t rqnode = rg->eth.src[5];
+	assert(rqnode > 0 && rqnode <= NET_MAXNODES && rqnode != net_node);
+	if (len < sizeof(*rg) || rg->count > NET_PULLRANGE) {
+		warn("net_rxpullrg: bad range pull request");
+		return;
+	}
+
+	int i;
+	for (i = 0; i < rg->count; i++) {
+		int need = 0, part;
+		for (part = 0; part < 3; part++)
+			if (rg->need[part] & (1 << i))
+				need |= 1 << part;
+		net_pullserve(rqnode, rg->rr[i], rg->pglev, need);
+	}
+}
+
 static const int partlen[3] = {
 	NET_PULLPART0, NET_PULLPART1, NET_PULLPART2};
 
-void
-net_txpullrp(uint8_t rqnode, uint32_t rr, int pglev, int part, void *pg)
+// Convert a PDE or PTE from a page directory or page table we're sending
+// to node 'dstnode' into the remote reference it should see in its place.
+// A local page we name this way is shared with that node from now on,
+// so it stays put even after we drop our own mappings of it
+// (e.g., when a process that was here comes back with a new pdir):
+// the RR may come back to us from anywhere, as long as any node holds it.
+// XXX it's not ideal that we just believe the requestor's word
+// about whether this is a page table or regular page;
+// would be better if we kept our own type info in struct pageinfo.
+static uint32_t
+net_rrconv(uint32_t pte, int pglev, uint8_t dstnode)
 {
-	//cprintf("txpullrp\n");
-	// Find appropriate part of this page
-	void *data = pg + NET_PULLPART*part;
-	int len = partlen[part];
-	assert(len <= NET_PULLPART);
-	assert((len & 3) == 0);		// must contain only whole PTEs
+	// Lab 5: convert the PDEs or PTEs into corresponding remote refs.
+	// For PDEs/PTEs pointing to PMAP_ZERO,
+	// produce an RR that is zero except for the RR_REMOTE
+	// and the PDE/PTE's nominal permissions.
+	// Empty entries stay empty, so tables encode compactly.
+	if (pte == 0)
+		return 0;
+
+	// A page the process has written to is PTE_W
+	// with its nominal permissions cleared.
+	uint32_t perm = pte & RR_RW;
+	if ((pte & PTE_P) && (pte & PTE_W))
+		perm = RR_RW;
+	if (!PTE_LOCAL(pte))
+		return pte;	// Still remote here too: pass it along as is
+	if (PGADDR(pte) == PTE_ZERO)
+		return RRCONS(net_node, 0, perm);
+	pageinfo *pi = mem_phys2pi(PGADDR(pte));
+	if (pi->home != 0 && pglev != PGLEV_PDIR)
+		return pi->home;
+	net_rrshare(mem_ptr(PGADDR(pte)), dstnode);
+	return RRCONS(net_node, PGADDR(pte), perm);
+}
 
-	// If we're transmitting part of a page directory or page table,
-	// then first convert all PTEs into remote references.
-	// XXX it's not ideal that we just believe the requestor's word
-	// about whether this is a page table or regular page;
-	// would be better if we kept our own type info in struct pageinfo.
-	int nrrs = len/4;
-	uint32_t rrs[nrrs];
-	if (pglev > 0) {
-		const uint32_t *pt = data;
-		// Lab 5: convert the PDEs or PTEs in pt[0..nrrs-1]
-		// into corresponding remote references in rrs[0..nrrs-1].
-		// For PDEs/PTEs pointing to PMAP_ZERO,
-		// produce an RR that is zero except for the RR_REMOTE
-		// and the PDE/PTE's nominal permissions.
-		// For page directories, just produce zero RRs
-		// for PDEs representing the non-user portions
-		// of the address space.
-		int i = 0;
-		
-		for (i; i < nrrs; i++){
-			if (PGADDR(pt[i]) == PTE_ZERO){
-				rrs[i] = RRCONS(net_node, 0, RR_RW & pt[i]);
+// Encoding buffers, used only with net_enclock held.
+static uint8_t net_encbuf[NET_PULLPART];
+static uint32_t net_enctab[NPTENTRIES];
+#define NET_LZBITS	10		// log2 of LZ hash table size
+static uint16_t net_lztab[1 << NET_LZBITS];
+
+// Returns the words of page 'pg' as node 'dstnode' should see them:
+// for a page directory or page table, converted into net_enctab.
+// The kernel part of a page directory is the receiver's own business.
+static const uint32_t *
+net_pullwords(const uint32_t *pg, int pglev, uint8_t dstnode)
+{
+	if (pglev == PGLEV_PAGE)
+		return pg;
+	int i;
+	for (i = 0; i < NPTENTRIES; i++)
+		net_enctab[i] = pglev == PGLEV_PDIR && (i < PDX(VM_USERLO)
+				|| i >= PDX(VM_USERHI)) ? 0 :
+				net_rrconv(pg[i], pglev, dstnode);
+	return net_enctab;
+}
+
+// Run-length encode page 'pg' into 'out' as a series of 16-bit tokens:
+// 0x8000|n for a run of n zero words, or n followed by n nonzero words.
+// Returns the encoded length, or -1 if it won't fit in 'max' bytes.
+static int
+net_rleenc(const uint32_t *pg, uint8_t *out, int max)
+{
+	int i = 0, j, o = 0;
+	while (i < NPTENTRIES) {
+		bool zero = pg[i] == 0;
+		for (j = i+1; j < NPTENTRIES; j++)
+			if ((pg[j] == 0) != zero)
+				break;
+		int n = j - i;
+		if (o + 2 + (zero ? 0 : n*4) > max)
+			return -1;
+		uint16_t tok = zero ? 0x8000 | n : n;
+		memcpy(out + o, &tok, 2);
+		o += 2;
+		if (!zero) {
+			memcpy(out + o, &pg[i], n*4);
+			o += n*4;
+		}
+		i = j;
+	}
+	return o;
+}
+
+static bool
+net_rledec(uint32_t *pg, const uint8_t *in, int len)
+{
+	int i = 0, o = 0;
+	while (i < NPTENTRIES) {
+		uint16_t tok;
+		if (o + 2 > len)
+			return false;
+		memcpy(&tok, in + o, 2);
+		o += 2;
+		int n = tok & 0x7fff;
+		if (n == 0 || i + n > NPTENTRIES)
+			return false;
+		if (tok & 0x8000) {
+			memset(&pg[i], 0, n*4);
+		} else {
+			if (o + n*4 > len)
+				return false;
+			memcpy(&pg[i], in + o, n*4);
+			o += n*4;
+		}
+		i += n;
+	}
+	return true;
+}
+
+// Size of the sparse encoding below for page table 'pt',
+// setting '*fill' to the value most of its entries have.
+static int
+net_sparselen(const uint32_t *pt, uint32_t *fill)
+{
+	// Find the majority value, if any (Boyer-Moore vote).
+	uint32_t cand = 0;
+	int i, n = 0;
+	for (i = 0; i < NPTENTRIES; i++) {
+		if (n == 0)
+			cand = pt[i];
+		n += pt[i] == cand ? 1 : -1;
+	}
+	for (i = n = 0; i < NPTENTRIES; i++)
+		n += pt[i] != cand;
+	*fill = cand;
+	return 4 + 6*n;
+}
+
+// Sparse-encode page table or directory 'pt' into 'out', 'len' bytes long
+// as computed by net_sparselen(): the 32-bit 'fill' value of most entries,
+// then a 16-bit index and 32-bit value for each entry that differs.
+static void
+net_sparseenc(const uint32_t *pt, uint32_t fill, uint8_t *out, int len)
+{
+	memcpy(out, &fill, 4);
+	int o = 4;
+	uint16_t i;
+	for (i = 0; i < NPTENTRIES; i++) {
+		if (pt[i] == fill)
+			continue;
+		memcpy(out + o, &i, 2);
+		memcpy(out + o + 2, &pt[i], 4);
+		o += 6;
+	}
+	assert(o == len);
+}
+
+static bool
+net_sparsedec(uint32_t *pt, const uint8_t *in, int len)
+{
+	if (len < 4 || (len - 4) % 6 != 0)
+		return false;
+	uint32_t fill;
+	memcpy(&fill, in, 4);
+	int i, o;
+	for (i = 0; i < NPTENTRIES; i++)
+		pt[i] = fill;
+	for (o = 4; o < len; o += 6) {
+		uint16_t idx;
+		memcpy(&idx, in + o, 2);
+		if (idx >= NPTENTRIES)
+			return false;
+		memcpy(&pt[idx], in + o + 2, 4);
+	}
+	return true;
+}
+
+// LZ-compress data page 'pg' into 'out' as a series of sequences:
+// a count byte and that many literal bytes, then, unless that finishes
+// the page, a byte m and if m is nonzero a 16-bit offset back
+// from which to copy m+3 bytes.
+// Returns the encoded length, or -1 if it won't fit in 'max' bytes.
+static int
+net_lzenc(const uint8_t *pg, uint8_t *out, int max)
+{
+	memset(net_lztab, 0xff, sizeof(net_lztab));
+	int i = 0, lit = 0, o = 0;
+	while (i < PAGESIZE) {
+		int mlen = 0;
+		uint16_t off = 0;
+		if (i + 4 <= PAGESIZE) {
+			uint32_t w;
+			memcpy(&w, pg + i, 4);
+			int h = (w * 2654435761U) >> (32 - NET_LZBITS);
+			int cand = net_lztab[h];
+			net_lztab[h] = i;
+			if (cand != 0xffff && memcmp(pg + cand, pg + i, 4) == 0) {
+				mlen = 4;
+				while (i + mlen < PAGESIZE && mlen < 255 + 3
+						&& pg[cand + mlen] == pg[i + mlen])
+					mlen++;
+				off = i - cand;
 			}
-			else {
-				pageinfo* pi = mem_phys2pi(PGADDR(pt[i]));
-				if (pi->home == 0 || pglev == PGLEV_PDIR) {
-					rrs[i] = RRCONS(net_node, PGADDR(pt[i]), RR_RW & pt[i]);
-				}
-				else {
-					rrs[i] = pi->home;
-				}
+		}
+		if (mlen == 0) {
+			i++;
+			if (i - lit < 255 && i < PAGESIZE)
+				continue;	// keep gathering literals
+		}
+
+		// Emit the literals from 'lit' up to here, then the match.
+		int n = i - lit;
+		if (o + 1 + n + 3 > max)
+			return -1;
+		out[o++] = n;
+		memcpy(out + o, pg + lit, n);
+		o += n;
+		if (lit + n < PAGESIZE) {
+			out[o++] = mlen ? mlen - 3 : 0;
+			if (mlen) {
+				memcpy(out + o, &off, 2);
+				o += 2;
 			}
 		}
-		
-		data = rrs;	// Send RRs instead of original page.
+		i += mlen;
+		lit = i;
+	}
+	return o;
+}
+
+static bool
+net_lzdec(uint8_t *pg, const uint8_t *in, int len)
+{
+	int i = 0, o = 0;
+	while (i < PAGESIZE) {
+		if (o >= len)
+			return false;
+		int n = in[o++];
+		if (o + n > len || i + n > PAGESIZE)
+			return false;
+		memcpy(pg + i, in + o, n);
+		o += n;
+		i += n;
+		if (i == PAGESIZE)
+			break;
+		if (o >= len)
+			return false;
+		int mlen = in[o++];
+		if (mlen == 0)
+			continue;
+		mlen += 3;
+		uint16_t off;
+		if (o + 2 > len)
+			return false;
+		memcpy(&off, in + o, 2);
+		o += 2;
+		if (off == 0 || off > i || i + mlen > PAGESIZE)
+			return false;
+		for (; mlen > 0; mlen--, i++)	// may overlap: copy bytewise
+			pg[i] = pg[i - off];
+	}
+	return true;
+}
+
+// Encode a whole page for a pull reply into 'out' as compactly as we can,
+// given its words as net_pullwords() returns them,
+// returning the length and setting '*enc' to the encoding used,
+// or returning -1 if it won't fit in 'max' bytes.
+static int
+net_encode(const uint32_t *pg, int pglev, uint8_t *out, int max, int *enc)
+{
+	// Page tables and directories are mostly empty or zero-page entries:
+	// send the others by index, unless RLE comes out smaller.
+	int len;
+	if (pglev > PGLEV_PAGE) {
+		uint32_t fill;
+		int slen = net_sparselen(pg, &fill);
+		if (fill == 0 && slen == 4) {
+			*enc = NET_ENC_ZERO;
+			return 0;
+		}
+		if ((len = net_rleenc(pg, out, MIN(max, slen - 1))) >= 0) {
+			*enc = NET_ENC_RLE;
+			return len;
+		}
+		if (slen > max)
+			return -1;
+		net_sparseenc(pg, fill, out, slen);
+		*enc = NET_ENC_SPARSE;
+		return slen;
+	}
+
+	len = net_rleenc(pg, out, max);
+	if (len == 2 && (out[1] & 0x80)) {	// a single run of zeros
+		*enc = NET_ENC_ZERO;
+		return 0;
+	}
+	if (len >= 0) {
+		*enc = NET_ENC_RLE;
+		return len;
+	}
+	if (NET_PULLLZ && (len = net_lzenc((const uint8_t*) pg, out, max)) >= 0) {
+		*enc = NET_ENC_LZ;
+		return len;
 	}
+	return -1;
+}
+
+// Decode a whole page received in a pull reply into 'pg'.
+// Returns false if the encoded data is malformed.
+static bool
+net_decode(void *pg, int enc, const uint8_t *data, int dlen)
+{
+	switch (enc) {
+	case NET_ENC_ZERO:
+		memset(pg, 0, PAGESIZE);
+		return true;
+	case NET_ENC_RLE:
+		return net_rledec(pg, data, dlen);
+	case NET_ENC_LZ:
+		return net_lzdec(pg, data, dlen);
+	case NET_ENC_SPARSE:
+		return net_sparsedec(pg, data, dlen);
+	default:
+		return false;
+	}
+}
 
-	// Build and send the message
+// Send the parts of page 'pg' that node 'rqnode' 'need's,
+// all in one packet if it needs the whole page and it encodes compactly.
+void
+net_txpullrp(uint8_t rqnode, uint32_t rr, int pglev, int need, void *pg)
+{
+	//cprintf("txpullrp\n");
 	net_pullrphdr rph;
 	net_ethsetup(&rph.eth, rqnode);
 	rph.type = NET_PULLRP;
 	rph.rr = rr;
-	rph.part = part;
-	net_tx(&rph, sizeof(rph), data, len);
+
+	// If we're transmitting a page directory or page table,
+	// then first convert all PTEs into remote references.
+	spinlock_acquire(&net_enclock);
+	const uint32_t *words = net_pullwords(pg, pglev, rqnode);
+	if (need == 7 && (rph.dlen = net_encode(words, pglev, net_encbuf,
+				NET_PULLPART, &rph.enc)) >= 0) {
+		rph.part = NET_PULLWHOLE;
+		net_tx(&rph, sizeof(rph), net_encbuf, rph.dlen);
+		spinlock_release(&net_enclock);
+		return;
+	}
+
+	// Send the parts raw.
+	// (We must divide the page into parts to fit into Ethernet packets.)
+	int part;
+	for (part = 0; part < 3; part++) {
+		if (!(need & (1 << part)))
+			continue;
+		int len = partlen[part];
+		assert(len <= NET_PULLPART);
+		assert((len & 3) == 0);		// must contain only whole PTEs
+		rph.part = part;
+		rph.enc = NET_ENC_RAW;
+		rph.dlen = len;
+		net_tx(&rph, sizeof(rph), (void*) words + NET_PULLPART*part,
+			len);
+	}
+	spinlock_release(&net_enclock);
 }
 
 void
 net_rxpullrp(net_pullrphdr *rp, int len)
 {
-	static const int partlen[3] = {
-		NET_PULLPART0, NET_PULLPART1, NET_PULLPART2};
-
 	assert(rp->type == NET_PULLRP);
 
-	spinlock_acquire(&net_lock);
-
-	// Find the process waiting for this pull reply, if any.
-	proc *p, **pp;
-	for (pp = &net_pulllist; (p = *pp) != NULL; pp = &p->pullnext) {
-		assert(p->state == PROC_PULL);
-		if (p->pullrr == rp->rr)
-			break;
-	}
-	if (p == NULL) {	// Probably a duplicate due to retransmission
-		//warn("net_rxpullrp: no process waiting for RR %x", rp->rr);
-		return spinlock_release(&net_lock);
-	}
 	int part = rp->part;
-	if (part < 0 || part > 2) {
+	if (part < 0 || part > NET_PULLWHOLE) {
 		warn("net_rxpullrp: invalid part number %d", part);
-		return spinlock_release(&net_lock);
-	}
-	if (p->arrived & (1 << rp->part)) {
-		warn("net_rxpullrp: part %d already arrived", part);
-		return spinlock_release(&net_lock);
+		return;
 	}
 	int datalen = len - sizeof(*rp);
-	if (datalen != partlen[rp->part]) {
+	bool whole = part == NET_PULLWHOLE;
+	if (whole ? rp->dlen < 0 || rp->dlen > datalen
+			: rp->enc != NET_ENC_RAW || datalen != partlen[part]) {
 		warn("net_rxpullrp: part %d wrong size %d", part, datalen);
-		return spinlock_release(&net_lock);
+		return;
 	}
 
-	// Fill in the appropriate part of the page.
-	memcpy(p->pullpg + NET_PULLPART*part, rp->data, datalen);
-	p->arrived |= 1 << rp->part;	// Mark this part arrived.
-	if (p->arrived == 7)		// All three parts arrived?
-		*pp = p->pullnext;	// Remove from list of waiting procs.
+	spinlock_acquire(&net_lock);
 
-	spinlock_release(&net_lock);
+	// Fill in this part of the page for every pull waiting for it:
+	// there can be several if processes want the same remote page.
+	// Free the slots of pulls that are now complete,
+	// and wake up their processes if they are waiting for them,
+	// chaining those through readynext until we can call proc_ready().
+	// Anything else is probably a duplicate due to retransmission.
+	proc *p, **pp, *done = NULL;
+	for (pp = &net_pulllist; (p = *pp) != NULL; ) {
+		int i;
+		for (i = 0; i < NET_PULLWIN; i++) {
+			net_pullslot *ps = &p->pull[i];
+			int bits = whole ? 7 : 1 << part;
+			if (ps->rr != rp->rr || (ps->arrived & bits) == bits)
+				continue;
+			if (whole) {	// Decode the page in place.
+				if (!net_decode(ps->pg, rp->enc,
+						(uint8_t*) rp->data, rp->dlen)) {
+					warn("net_rxpullrp: bad encoding %d",
+						rp->enc);
+					continue;
+				}
+				ps->arrived = 7;
+			} else {
+				memcpy(ps->pg + NET_PULLPART*part, rp->data,
+					datalen);
+				ps->arrived |= 1 << part; // Mark part arrived.
+				if (ps->arrived != 7)	// Wait for other parts
+					continue;
+			}
 
-	if (p->arrived != 7)
-		return;			// Wait for remaining parts
+			// If this was a page directory,
+			// reinitialize the kernel portions.
+			if (ps->pglev == PGLEV_PDIR) {
+				uint32_t *pdir = ps->pg;
+				int j;
+				for (j = 0; j < NPDENTRIES; j++) {
+					if (j == PDX(VM_USERLO)) // skip user area
+						j = PDX(VM_USERHI);
+					pdir[j] = pmap_bootpdir[j];
+				}
+			}
 
-	// If this was a page directory, reinitialize the kernel portions.
-	if (p->pglev == PGLEV_PDIR) {
-		uint32_t *pdir = p->pullpg;
-		int i;
-		for (i = 0; i < NPDENTRIES; i++) {
-			if (i == PDX(VM_USERLO))	// skip user area
-				i = PDX(VM_USERHI);
-			pdir[i] = pmap_bootpdir[i];
+			ps->rr = 0;
+			p->npull--;
+			if (p->pullwait == ps) {
+				assert(p->state == PROC_PULL);
+				p->pullwait = NULL;
+				p->readynext = done;
+				done = p;
+			}
 		}
+		if (p->npull == 0)	// Remove from list of pulling procs.
+			*pp = p->pullnext;
+		else
+			pp = &p->pullnext;
 	}
 
-	// Done - what else does this proc need to pull before it can run?
-	// Remove/disable this code if the VM system supports pull-on-demand.
-	while (p->pullva < VM_USERHI) {
+	spinlock_release(&net_lock);
 
-		// Pull or traverse PDE to find page table.
-		uint32_t *pde = &p->pdir[PDX(p->pullva)];
-		if (*pde & PTE_REMOTE) {	// Need to pull remote ptab?
-			if (!net_pullpte(p, pde, PGLEV_PTAB))
-				return; // Wait for the pull to complete.
-		}
-		assert(!(*pde & PTE_REMOTE));
-		if (PGADDR(*pde) == PTE_ZERO) {		// Skip empty PDEs
-			p->pullva = PTADDR(p->pullva + PTSIZE);
-			continue;
-		}
-		assert(PGADDR(*pde) != 0);
-		uint32_t *ptab = mem_ptr(PGADDR(*pde));
-
-		// Pull or traverse PTE to find page.
-		uint32_t *pte = &ptab[PTX(p->pullva)];
-		if (*pte & PTE_REMOTE) {	// Need to pull remote page?
-			if (!net_pullpte(p, pte, PGLEV_PAGE))
-				return;	// Wait for the pull to complete.
-		}
-		assert(!(*pte & PTE_REMOTE));
-		assert(PGADDR(*pte) != 0);
-		p->pullva += PAGESIZE;	// Page is local - move to next.
+	// The procs can run again: a newly migrated one as soon as
+	// its page directory is here, since its page tables and pages
+	// get pulled on demand as it touches them (see net_fetch).
+	while ((p = done) != NULL) {
+		done = p->readynext;
+		proc_ready(p);
 	}
+}
 
-	// We've pulled the proc's entire address space: it's ready to go!
-	//cprintf("net_rxpullrp: migration complete\n");
-	proc_ready(p);
+// Nominal permissions for a local PTE standing in for a page-level RR:
+// the mapping is present only if it is readable, as for zero mappings.
+static uint32_t
+net_rrperm(uint32_t rr)
+{
+	uint32_t perm = rr & RR_RW;
+	return (perm & SYS_READ) ? perm | PTE_P | PTE_U : perm;
 }
 
-// See if we need to pull a page to fill a given PDE or PTE.
-// Returns false if we started a pull and need to wait until it's finished,
-// or true if we were able to resolve the RR immediately.
-bool
-net_pullpte(proc *p, uint32_t *pte, int pglevel)
+// Returns the slot in which some process is pulling into local page 'pg',
+// preferring one of p's own slots, or NULL if no one is pulling it.
+static net_pullslot *
+net_pulling(proc *p, void *pg)
+{
+	spinlock_acquire(&net_lock);
+	net_pullslot *found = NULL;
+	proc *q;
+	for (q = net_pulllist; q != NULL; q = q->pullnext) {
+		int i;
+		for (i = 0; i < NET_PULLWIN; i++)
+			if (q->pull[i].rr != 0 && q->pull[i].pg == pg
+					&& (found == NULL || q == p))
+				found = &q->pull[i];
+	}
+	spinlock_release(&net_lock);
+	return found;
+}
+
+// Resolve the RR at 'pte' into a local PDE or PTE if we can do so
+// without waiting for the network, returning true if we did.
+static bool
+net_resolve(uint32_t *pte, int pglevel)
 {
 	uint32_t rr = *pte;
 	assert(rr & RR_REMOTE);
@@ -608,37 +1127,154 @@ net_pullpte(proc *p, uint32_t *pte, int pglevel)
 	// and figure out how to convert it to a local PDE or PTE.
 	// There are four important cases to handle:
 	// - The RR is zero except for RR_REMOTE and RR_RW (the permissions):
-	//   convert it into a PTE_ZERO mapping immediately, and return 1.
+	//   convert it into a PTE_ZERO mapping immediately.
 	// - The RR refers to a page on OUR node (RRNODE(rr) == net_node):
-	//   convert it directly back into a PDE or PTE and return 1.
+	//   convert it directly back into a PDE or PTE.
 	// - The RR refers to a page whose home is on another node,
 	//   but which we've seen before (mem_rrlookup(rr) != NULL):
-	//   convert it directly into a PDE or PTE and return 1.
+	//   convert it directly into a PDE or PTE, once it has arrived.
 	// - The RR refers to a remote page we haven't seen before:
-	//   allocate a page to hold a local copy,
-	//   initiate a pull on that page by calling net_pull(),
-	//   and return 0 indicating we have to wait for the pull to complete.
-
+	//   we must pull it, as net_pullpte() does.
+	// Pages keep their nominal permissions and stay copy-on-write,
+	// so the page an RR names never changes under anyone holding it.
 	if (RRADDR(rr) == 0){
-		*pte = PTE_ZERO;
+		*pte = pglevel ? PTE_ZERO : PTE_ZERO | net_rrperm(rr);
 		return true;
 	}
 	else if (RRNODE(rr) == net_node) {
-		*pte = RRADDR(rr) | (rr & RR_RW) | PTE_P | PTE_U | PTE_W; //TODO
+		mem_incref(mem_phys2pi(RRADDR(rr)));
+		*pte = RRADDR(rr) | (pglevel ? (rr & RR_RW) | PTE_P | PTE_U
+				| PTE_W : net_rrperm(rr));
 		return true;
 	}
-	else if (mem_rrlookup(rr)) {
-		pageinfo* pi = mem_rrlookup(rr);
-		*pte = PGADDR(mem_pi2phys(pi)) | PTE_P | PTE_U | SYS_RW;
-		if (pglevel) *pte |= PTE_W;
-		return true;
+
+	pageinfo *pi = mem_rrlookup(rr);
+	if (pi == NULL)
+		return false;
+	if (net_pulling(NULL, mem_pi2ptr(pi)) != NULL) {
+		mem_decref(pi, mem_free);	// Still on its way
+		return false;
 	}
-	else {
-		pageinfo* pi = mem_alloc();
-		pi->refcount++;
+	*pte = PGADDR(mem_pi2phys(pi)) | (pglevel ? PTE_P | PTE_U
+			| PTE_W | SYS_RW : net_rrperm(rr));
+	return true;
+}
+
+// Start pulling the page named by an RR that net_resolve() couldn't resolve
+// on behalf of process p, into the page that already tracks it if any,
+// and return the pull slot; or return NULL if there's no memory for it.
+static net_pullslot *
+net_pullstart(proc *p, uint32_t rr, int pglevel)
+{
+	pageinfo *pi = mem_rrlookup(rr);
+	if (pi != NULL) {
+		// Someone else is still pulling it: pull it too,
+		// and take our reference once it's here.
+		mem_decref(pi, mem_free);
+	} else {
+		// The local copy keeps the reference we allocate it with
+		// while it's tracked, so mappings of it are copy-on-write.
+		pi = mem_alloc();
+		if (pi == NULL)
+			return NULL;
+		mem_incref(pi);
 		mem_rrtrack(rr, pi);
-		net_pull(p, *pte, mem_pi2ptr(pi), pglevel);
-		return false;
 	}
+	return net_pull(p, rr, mem_pi2ptr(pi), pglevel);
+}
+
+// Resolve what we can of the 'n' RRs following 'pte' in the same table
+// for process p, and start pulling the rest without waiting for them,
+// as long as p's pull window has room besides a slot for the page it needs.
+// The process finds them here when it gets to them.
+static void
+net_pullahead(proc *p, uint32_t *pte, int n, int pglevel)
+{
+	for (; n > 0 && p->npull < NET_PULLWIN - 1; n--) {
+		uint32_t rr = *++pte;
+		if (PTE_LOCAL(rr) || net_resolve(pte, pglevel))
+			continue;
+		pageinfo *pi = mem_rrlookup(rr);
+		if (pi != NULL) {		// Already on its way
+			mem_decref(pi, mem_free);
+			continue;
+		}
+		if (net_pullstart(p, rr, pglevel) == NULL)
+			return;			// Out of memory: no matter
+	}
+}
+
+// See if we need to pull a page to fill a given PDE or PTE
+// in the page tables of the current process, which trapped with 'tf',
+// pulling ahead any remote pages in the 'ahead' entries following it.
+// Returns false if we need to wait until a pull is finished,
+// having saved the process as proc_save() does with 'entry',
+// or true if we were able to resolve the RR immediately.
+bool
+net_pullpte(trapframe *tf, int entry, uint32_t *pte, int pglevel, int ahead)
+{
+	proc *p = proc_cur();
+	bool local = net_resolve(pte, pglevel);
+	net_pullahead(p, pte, ahead, pglevel);
+	if (local) {
+		net_pullsend(p);
+		return true;
+	}
+
+	// Wait for the page, in a pull of our own if we pulled it ahead.
+	uint32_t rr = *pte;
+	pageinfo *pi = mem_rrlookup(rr);
+	net_pullslot *ps = NULL;
+	if (pi != NULL) {
+		ps = net_pulling(p, mem_pi2ptr(pi));
+		mem_decref(pi, mem_free);
+		if (ps != NULL && (ps < p->pull || ps >= &p->pull[NET_PULLWIN]))
+			ps = NULL;		// Someone else's pull
+	}
+	if (ps == NULL && (ps = net_pullstart(p, rr, pglevel)) == NULL)
+		panic("net_pullpte: out of memory");
+	net_pullsend(p);
+	proc_save(p, tf, entry);
+	net_pullwait(p, ps);
+	return false;
+}
+
+// Make sure the PDE or PTE at 'pte' in the current process's page tables
+// (or those of a child it is operating on) is local, not a remote reference.
+// If the page must be pulled from another node first, this blocks the
+// process until it arrives and restarts it as proc_save() does with 'entry',
+// retrying the faulting instruction or system call; otherwise it returns.
+// Either way, remote pages named by up to 'ahead' entries following 'pte'
+// in the same table start coming in while the process goes on.
+void
+net_fetch(trapframe *tf, int entry, uint32_t *pte, int pglevel, int ahead)
+{
+	if (!PTE_LOCAL(*pte) && !net_pullpte(tf, entry, pte, pglevel, ahead))
+		proc_sched();
 }
 
+// Make 'size' bytes at 'va' in 'pdir' local as net_fetch() does:
+// the page tables covering them, and the pages themselves if 'pages'.
+// Kernel code walking a migrated process's page tables calls this first.
+void
+net_localize(trapframe *tf, int entry, pde_t *pdir, uint32_t va, size_t size,
+		bool pages)
+{
+	assert(va >= VM_USERLO && va <= VM_USERHI && size <= VM_USERHI - va);
+
+	uint32_t end = va + size;
+	va = ROUNDDOWN(va, PAGESIZE);
+	while (va < end) {
+		pde_t *pde = &pdir[PDX(va)];
+		net_fetch(tf, entry, pde, PGLEV_PTAB, PDX(end - 1) - PDX(va));
+		if (!pages || PGADDR(*pde) == PTE_ZERO) {
+			va = PTADDR(va) + PTSIZE;
+			continue;
+		}
+		pte_t *ptab = mem_ptr(PGADDR(*pde));
+		uint32_t ptend = MIN(end - 1, PTADDR(va) + PTSIZE - 1);
+		net_fetch(tf, entry, &ptab[PTX(va)], PGLEV_PAGE,
+				PTX(ptend) - PTX(va));
+		va += PAGESIZE;
+	}
+}
@@ -39,6 +39,7 @@ typedef enum net_msgtype {
 	NET_MIGRP,		// Migrate reply
 	NET_PULLRQ,		// Page pull request
 	NET_PULLRP,		// Page pull reply
+	NET_PULLRG,		// Range pull request
 } net_msgtype;
 
 // Minimal packet header for all our network messages
@@ -47,18 +48,29 @@ typedef struct net_hdr {
 	net_msgtype	type;	// Message request/response type
 } net_hdr;
 
+#define NET_MIGRDIRTY	128		// Most dirty regions in a migrq
+#define NET_DIRTYALL	0xffff		// Too many to list: assume all are
+
 typedef struct net_migrq {
 	net_ethhdr	eth;
 	net_msgtype	type;	// = NET_MIGRQ
 	uint32_t	home;	// Remote ref for proc's home node & physaddr
 	uint32_t	pdir;	// Remote ref for proc's page directory
+	uint32_t	load;	// Sender's ready queue length, for kinfo
 	procstate	save;	// Process's saved user-visible state
+
+	// The 4MB regions whose mappings the proc changed since it left home,
+	// with RRs to their page tables; the rest the home node still has.
+	uint16_t	ndirty;	// Number of regions, or NET_DIRTYALL
+	uint16_t	dirtyidx[NET_MIGRDIRTY]; // Page directory index of each
+	uint32_t	dirtyrr[NET_MIGRDIRTY];	// RR to page table of each
 } net_migrq;
 
 typedef struct net_migrp {
 	net_ethhdr	eth;
 	net_msgtype	type;	// = NET_MIGRP
 	uint32_t	home;	// Remote ref for proc being acknowledged
+	uint32_t	load;	// Sender's ready queue length, for kinfo
 } net_migrp;
 
 // Pull a page from a remote node
@@ -79,10 +91,63 @@ typedef struct net_pullrphdr {
 	net_ethhdr	eth;
 	net_msgtype	type;	// = NET_PULLRP
 	uint32_t	rr;	// Remote reference
-	int		part;	// Which part of the page this is: 0, 1, or 2
+	int		part;	// Which part of the page this is: 0, 1, or 2,
+				// or NET_PULLWHOLE for all of it, encoded
+	int		enc;	// How the data is encoded: see below
+	int		dlen;	// Length of data (packet may be padded)
 	char		data[0]; // Variable-length payload follows pullrphdr
 } net_pullrphdr;
 
+// Most pages fit in one pull reply when encoded compactly;
+// others are sent raw, in three parts as above.
+#define NET_PULLWHOLE	3		// Part number for a whole page
+#define NET_ENC_RAW	0		// Raw part of a page
+#define NET_ENC_ZERO	1		// Whole page is zero: no data at all
+#define NET_ENC_RLE	2		// Runs of zero and nonzero words
+#define NET_ENC_LZ	3		// LZ-compressed bytes (see net.c)
+#define NET_ENC_SPARSE	4		// Page table: entries differing from
+					// the most common one, by index
+
+// The LZ encoding is optional for the sender: page tables and
+// mostly-zero pages do fine with RLE, which costs less to produce.
+// Build with DEFS=-DNET_PULLLZ=0 to send only zero and RLE pages.
+#ifndef NET_PULLLZ
+#define NET_PULLLZ	1
+#endif
+
+// Pull a range of pages from a remote node with one request,
+// such as those named by consecutive entries of a page table.
+// The home node streams back the needed parts of all of them as pullrps;
+// we retransmit the request with only the parts still missing.
+#define NET_PULLRANGE	16		// Most pages in one range pull
+typedef struct net_pullrg {
+	net_ethhdr	eth;
+	net_msgtype	type;	// = NET_PULLRG
+	uint8_t		pglev;	// 0=page, 1=page table, 2=page directory
+	uint8_t		count;	// Number of remote refs in rr[]
+	uint16_t	need[3]; // Per part: bit i set if rr[i] needs it
+	uint32_t	rr[NET_PULLRANGE]; // Remote refs, all to the same node
+} net_pullrg;
+
+// Number of page pulls each process may have in flight at once:
+// besides the page it is waiting for, a process pulls ahead the pages
+// that follow it in the same table (see net_fetch),
+// requesting those it starts together in range pulls.
+// The replies to a full window must fit in the e100's 64 transmit slots.
+// Build with DEFS=-DNET_PULLWIN=1 to pull one page at a time.
+#ifndef NET_PULLWIN
+#define NET_PULLWIN	16
+#endif
+
+// One in-flight page pull, in a process's window of pulls.
+typedef struct net_pullslot {
+	uint32_t	rr;	// RR we are pulling, or 0 if slot is free
+	void		*pg;	// Local page we are pulling into
+	uint8_t		pglev;	// Level: 0=page, 1=page table, 2=pdir
+	uint8_t		arrived; // Bits 0-2: which parts have arrived
+	uint8_t		unsent;	// Not requested yet: see net_txpullrq()
+} net_pullslot;
+
 
 // 32-bit remote reference layout.
 // Note that bit 0, corresponding to PTE_P, must always be zero,
@@ -111,10 +176,17 @@ extern uint8_t net_mac[6];	// My MAC address from the Ethernet card
 
 
 struct trapframe;
+struct proc;
 
 void net_init(void);
 void net_rx(void *ethpkt, int len);
 void net_tick(void);
+bool net_pending(void);
 void gcc_noreturn net_migrate(struct trapframe *tf, uint8_t node, int entry);
+void net_dirty(struct proc *p, uint32_t va, size_t size);
+void net_fetch(struct trapframe *tf, int entry, uint32_t *pte, int pglevel,
+		int ahead);
+void net_localize(struct trapframe *tf, int entry, uint32_t *pdir,
+		uint32_t va, size_t size, bool pages);
 
 #endif // !PIOS_KERN_NET_H
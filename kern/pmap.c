@@ -21,6 +21,8 @@
 #include <kern/trap.h>
 #include <kern/proc.h>
 #include <kern/pmap.h>
+#include <kern/kinfo.h>
+#include <kern/net.h>
 
 
 // Statically allocated page directory mapping the kernel's address space.
@@ -74,6 +76,7 @@ pmap_init(void)
 				pmap_bootpdir[i] = (i << PDXSHIFT) | PTE_P | PTE_W | PTE_PS | PTE_G;
 			}
 		}
+		kinfo_init();	// Before any pdir gets cloned from bootpdir
 	}
 
 	// On x86, segmentation maps a VA to a LA (linear addr) and
@@ -88,6 +91,7 @@ pmap_init(void)
 	// Enable 4MB pages and global pages.
 	uint32_t cr4 = rcr4();
 	cr4 |= CR4_PSE | CR4_PGE;
+	cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;	// enable FXSAVE and SSE
 	lcr4(cr4);
 
 	// Install the bootstrap page directory into the PDBR.
@@ -111,7 +115,18 @@ pmap_init(void)
 pte_t *
 pmap_newpdir(void)
 {
-	pageinfo *pi = mem_alloc();
+	// Use a pre-initialized page directory from this CPU's pool if we can.
+	cpu *c = cpu_cur();
+	pageinfo *pi = c->pdirpool;
+	if (pi != NULL) {
+		c->pdirpool = pi->free_next;
+		c->npdirpool--;
+		pi->free_next = NULL;
+		mem_incref(pi);
+		return mem_pi2ptr(pi);
+	}
+
+	pi = mem_alloc();
 	if (pi == NULL)
 		return NULL;
 	mem_incref(pi);
@@ -124,11 +139,38 @@ pmap_newpdir(void)
 	return pdir;
 }
 
+// Top up the current CPU's pool of clean page directories.
+// Called from the idle loop, so the cloning happens off the fork path.
+void
+pmap_fillpool(void)
+{
+	cpu *c = cpu_cur();
+	if (c->npdirpool >= PMAP_PDIRPOOL)
+		return;
+	pageinfo *pi = mem_alloc();
+	if (pi == NULL)
+		return;
+	memmove(mem_pi2ptr(pi), pmap_bootpdir, PAGESIZE);
+	pi->free_next = c->pdirpool;
+	c->pdirpool = pi;
+	c->npdirpool++;
+}
+
 // Free a page directory, and all page tables and mappings it may contain.
+// Once its user part is cleared it is identical to pmap_bootpdir again,
+// so keep it in the current CPU's pool if there is room.
 void
 pmap_freepdir(pageinfo *pdirpi)
 {
 	pmap_remove(mem_pi2ptr(pdirpi), VM_USERLO, VM_USERHI-VM_USERLO);
+
+	cpu *c = cpu_cur();
+	if (c->npdirpool < PMAP_PDIRPOOL) {
+		pdirpi->free_next = c->pdirpool;
+		c->pdirpool = pdirpi;
+		c->npdirpool++;
+		return;
+	}
 	mem_free(pdirpi);
 }
 
@@ -139,7 +181,7 @@ pmap_freeptab(pageinfo *ptabpi)
 	pte_t *pte = mem_pi2ptr(ptabpi), *ptelim = pte + NPTENTRIES;
 	for (; pte < ptelim; pte++) {
 		uint32_t pgaddr = PGADDR(*pte);
-		if (pgaddr != PTE_ZERO)
+		if (pgaddr != PTE_ZERO && PTE_LOCAL(*pte))
 			mem_decref(mem_phys2pi(pgaddr), mem_free);
 	}
 	mem_free(ptabpi);
@@ -197,6 +239,9 @@ pmap_walk(pde_t *pdir, uint32_t va, bool writing)
 		}
 	}
 	else{
+		// A migrated process's page table may still be on another node:
+		// callers must net_localize() such a region before walking it.
+		assert(PTE_LOCAL(*pdentry));
 		//grab the page table pointed to by the entry
 		pte_t *ptable = (uint32_t *) PGADDR(*pdentry);
 		//return the page table entry given by the table and the offset in va
@@ -287,7 +332,8 @@ pmap_remove(pde_t *pdir, uint32_t va, size_t size)
 			pte_t *pte = pmap_walk(pdir, va, 1);
 			uint32_t addr = PGADDR(*pte);
 			if (addr != PTE_ZERO){
-				mem_decref(mem_phys2pi(addr),mem_free);
+				if (PTE_LOCAL(*pte))
+					mem_decref(mem_phys2pi(addr),mem_free);
 				*pte = PTE_ZERO;
 			}
 		}
@@ -300,7 +346,8 @@ pmap_remove(pde_t *pdir, uint32_t va, size_t size)
 			pdentry = &pdir[PDX(va)];
 			if (*pdentry != PTE_ZERO){
 				uint32_t addr = PGADDR(*pdentry);
-				mem_decref(mem_phys2pi(addr), pmap_freeptab);
+				if (PTE_LOCAL(*pdentry))  // not a remote ptab
+					mem_decref(mem_phys2pi(addr), pmap_freeptab);
 				*pdentry = PTE_ZERO;
 			}
 			va = va + PTSIZE;
@@ -317,7 +364,8 @@ pmap_remove(pde_t *pdir, uint32_t va, size_t size)
 			pte_t *pte = pmap_walk(pdir, va, 1);
 			uint32_t addr = PGADDR(*pte);
 			if (addr != PTE_ZERO){
-				mem_decref(mem_phys2pi(addr),mem_free);
+				if (PTE_LOCAL(*pte))
+					mem_decref(mem_phys2pi(addr),mem_free);
 				*pte = PTE_ZERO;
 			}
 		}
@@ -370,6 +418,7 @@ pmap_copy(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
 	
 	int j = 0;
 	for (; sva < end; sva += PTSIZE, spentry++, dpentry++){
+		assert(PTE_LOCAL(*spentry));	// net_localize()d by caller
 		if (PGADDR(*spentry) == PTE_ZERO){
 			*dpentry = *spentry;
 		} else {
@@ -379,6 +428,13 @@ pmap_copy(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
 			int i;
 			for (i = 0; i < NPTENTRIES; i++, entry++){
 					if(PGADDR(*entry) == PGADDR(PTE_ZERO)) continue;
+					if (!PTE_LOCAL(*entry))
+						continue;  // both pull it on demand
+					if (PTE_SHARED(*entry)) {
+						// Shared pages stay writable in both
+						mem_incref(mem_phys2pi(PGADDR(*entry)));
+						continue;
+					}
 					int perm = PGOFF(*entry) | SYS_READ;
 					if (perm & PTE_W || perm & SYS_WRITE){
 						perm = (perm & ~PTE_W) | SYS_WRITE;
@@ -395,6 +451,277 @@ pmap_copy(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
 	return 1;
 }
 
+//
+// Bring the mappings at dva in dpdir up to date with those at sva in spdir,
+// with the same result as pmap_copy but reusing dpdir's page tables.
+// A pmap_copy or pmap_sync leaves both sets of page tables identical,
+// so dpdir serves as its own reference snapshot: only the entries
+// either side has remapped since (after making the source copy-on-write)
+// get replaced, instead of every page being referenced all over again.
+// Returns true if successfull, false if not enough memory for copy,
+// in which case the 4MB regions before the one that failed are synced
+// and the rest are left as they were.
+//
+int
+pmap_sync(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
+		size_t size)
+{
+	assert(PTOFF(sva) == 0);	// must be 4MB-aligned
+	assert(PTOFF(dva) == 0);
+	assert(PTOFF(size) == 0);
+	assert(sva >= VM_USERLO && sva < VM_USERHI);
+	assert(dva >= VM_USERLO && dva < VM_USERHI);
+	assert(size <= VM_USERHI - sva);
+	assert(size <= VM_USERHI - dva);
+
+	pmap_inval(spdir, sva, size);
+	pmap_inval(dpdir, dva, size);
+
+	uint32_t end = sva + size;
+	for (; sva < end; sva += PTSIZE, dva += PTSIZE) {
+		pde_t *spde = &spdir[PDX(sva)];
+		pde_t *dpde = &dpdir[PDX(dva)];
+		assert(PTE_LOCAL(*spde));	// net_localize()d by caller
+		if (!PTE_LOCAL(*dpde))		// remote page table: replace it
+			*dpde = PTE_ZERO;
+		if (PGADDR(*spde) == PTE_ZERO) {
+			if (PGADDR(*dpde) != PTE_ZERO) {
+				mem_decref(mem_phys2pi(PGADDR(*dpde)),
+						pmap_freeptab);
+				*dpde = PTE_ZERO;
+			}
+			continue;
+		}
+		if (PGADDR(*dpde) == PTE_ZERO) {	// no page table to reuse
+			if (!pmap_copy(spdir, sva, dpdir, dva, PTSIZE))
+				return 0;
+			continue;
+		}
+
+		pte_t *spte = (pte_t *) PGADDR(*spde);
+		pte_t *dpte = (pte_t *) PGADDR(*dpde);
+		int i;
+		for (i = 0; i < NPTENTRIES; i++, spte++, dpte++) {
+			// Make the source copy-on-write just as pmap_copy does
+			pte_t pte = *spte;
+			if (PGADDR(pte) != PTE_ZERO && PTE_LOCAL(pte) &&
+					!PTE_SHARED(pte)) {
+				pte |= SYS_READ;
+				if (pte & (PTE_W | SYS_WRITE))
+					pte = (pte & ~PTE_W) | SYS_WRITE;
+				*spte = pte;
+			}
+			if (*dpte == pte)
+				continue;	// unchanged since last sync
+
+			if (PGADDR(pte) != PTE_ZERO && PTE_LOCAL(pte))
+				mem_incref(mem_phys2pi(PGADDR(pte)));
+			if (PGADDR(*dpte) != PTE_ZERO && PTE_LOCAL(*dpte))
+				mem_decref(mem_phys2pi(PGADDR(*dpte)), mem_free);
+			*dpte = pte;
+		}
+	}
+	return 1;
+}
+
+//
+// Map the pages from spdir's sva writably into dpdir at dva (could be the same)
+// so that both address spaces share the same physical pages from now on.
+// Source pages not already shared get an exclusive copy first,
+// so a pending copy-on-write or a zero mapping isn't shared by accident.
+// Such SYS_SHARE mappings stay shared across pmap_copy, never fault for
+// copy-on-write, and are left alone by pmap_merge.
+// Returns true if successfull, false if not enough memory,
+// in which case the pages before the one that failed are shared,
+// that one may be set up for sharing in spdir only,
+// and the rest are mapped as before.
+//
+int
+pmap_share(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
+		size_t size)
+{
+	assert(PGOFF(sva) == 0);	// must be page-aligned
+	assert(PGOFF(dva) == 0);
+	assert(PGOFF(size) == 0);
+	assert(sva >= VM_USERLO && sva < VM_USERHI);
+	assert(dva >= VM_USERLO && dva < VM_USERHI);
+	assert(size <= VM_USERHI - sva);
+	assert(size <= VM_USERHI - dva);
+
+	pmap_inval(spdir, sva, size);
+	pmap_inval(dpdir, dva, size);
+
+	uint32_t end = sva + size;
+	for (; sva < end; sva += PAGESIZE, dva += PAGESIZE) {
+		pte_t *spte = pmap_walk(spdir, sva, true);
+		if (spte == NULL)
+			return 0;
+		if (!PTE_SHARED(*spte)) {
+			uint32_t pa = PGADDR(*spte);
+			if (pa == PTE_ZERO || mem_phys2pi(pa)->refcount > 1) {
+				pageinfo *pi = mem_alloc();
+				if (pi == NULL)
+					return 0;
+				mem_incref(pi);
+				memmove(mem_pi2ptr(pi), (void *) pa, PAGESIZE);
+				if (pa != PTE_ZERO)
+					mem_decref(mem_phys2pi(pa), mem_free);
+				pa = mem_pi2phys(pi);
+			}
+			*spte = pa | SYS_SHARE | SYS_RW | PTE_P | PTE_W | PTE_U;
+		}
+
+		pte_t *dpte = pmap_walk(dpdir, dva, true);
+		if (dpte == NULL)
+			return 0;
+		if (PGADDR(*dpte) != PGADDR(*spte)) {
+			mem_incref(mem_phys2pi(PGADDR(*spte)));
+			if (PGADDR(*dpte) != PTE_ZERO)
+				mem_decref(mem_phys2pi(PGADDR(*dpte)), mem_free);
+		}
+		*dpte = PGADDR(*spte) | PGOFF(*spte & ~(PTE_A | PTE_D));
+	}
+	return 1;
+}
+
+//
+// Give the page mapped at 'pte', which has nominal SYS_WRITE permission,
+// a private copy the process can write to directly:
+// copies the zero page or a copy-on-write page if needed,
+// or a page other nodes hold remote references to, which must not change.
+// Returns true if successful, false if not enough memory.
+//
+static int
+pmap_ownpage(pte_t *pte)
+{
+	uint32_t pa = PGADDR(*pte);
+	if (pa == PTE_ZERO || mem_phys2pi(pa)->refcount > 1 ||
+			mem_phys2pi(pa)->shared) {
+		pageinfo *pi = mem_alloc();
+		if (pi == NULL)
+			return 0;
+		mem_incref(pi);
+		memmove(mem_pi2ptr(pi), (void *) pa, PAGESIZE);
+		if (pa != PTE_ZERO)
+			mem_decref(mem_phys2pi(pa), mem_free);
+		pa = mem_pi2phys(pi);
+	}
+	*pte = pa | ((PGOFF(*pte) | PTE_W | PTE_P) & ~SYS_RW);
+	return 1;
+}
+
+//
+// Populate a range of pages in 'pdir' ahead of time (SYS_WILLNEED):
+// give every page with nominal SYS_WRITE permission but no PTE_W
+// its own writable copy now, as if the process had written to each,
+// so it won't take one copy-on-write fault per page later.
+// Pages without nominal write permission and remote references are left
+// alone.  Returns true if successful, false if not enough memory.
+//
+int
+pmap_populate(pde_t *pdir, uint32_t va, size_t size)
+{
+	assert(PGOFF(va) == 0);
+	assert(PGOFF(size) == 0);
+	assert(va >= VM_USERLO && va < VM_USERHI);
+	assert(size <= VM_USERHI - va);
+
+	pmap_inval(pdir, va, size);
+
+	uint32_t end = va + size;
+	while (va < end) {
+		pte_t *pte = PTE_LOCAL(pdir[PDX(va)]) ?
+				pmap_walk(pdir, va, false) : NULL;
+		if (pte == NULL) {	// no page table here, or still remote
+			va = ROUNDDOWN(va, PTSIZE) + PTSIZE;
+			continue;
+		}
+		if ((*pte & (SYS_WRITE | PTE_W)) == SYS_WRITE &&
+				PTE_LOCAL(*pte) && !pmap_ownpage(pte))
+			return 0;
+		va += PAGESIZE;
+	}
+	return 1;
+}
+
+//
+// Make every page in a range of 'pdir' that is mapped writable
+// but that other nodes hold remote references to copy-on-write again,
+// so that the next write gets a private copy (see pmap_ownpage)
+// and those references keep seeing the contents they were given.
+// Page tables still remote, and SYS_SHARE mappings, are left alone.
+//
+void
+pmap_cowshared(pde_t *pdir, uint32_t va, size_t size)
+{
+	assert(PTOFF(va) == 0);
+	assert(PTOFF(size) == 0);
+	assert(va >= VM_USERLO && va < VM_USERHI);
+	assert(size <= VM_USERHI - va);
+
+	pmap_inval(pdir, va, size);
+
+	uint32_t end = va + size;
+	for (; va < end; va += PTSIZE) {
+		pde_t pde = pdir[PDX(va)];
+		if (!PTE_LOCAL(pde) || PGADDR(pde) == PTE_ZERO)
+			continue;
+		pte_t *pte = mem_ptr(PGADDR(pde));
+		int i;
+		for (i = 0; i < NPTENTRIES; i++, pte++) {
+			uint32_t pa = PGADDR(*pte);
+			if (!PTE_LOCAL(*pte) || pa == PTE_ZERO ||
+					!(*pte & PTE_P) || !(*pte & PTE_W) ||
+					PTE_SHARED(*pte) ||
+					!mem_phys2pi(pa)->shared)
+				continue;
+			// Restore the nominal permissions a write cleared.
+			*pte = (*pte & ~PTE_W) | SYS_RW;
+		}
+	}
+}
+
+//
+// Discard the contents of a range of pages in 'pdir' (SYS_DONTNEED),
+// leaving zero mappings with the same nominal permissions in their place:
+// unlike pmap_remove, this works at page granularity and keeps the
+// range accessible, just zero-filled again on the next access.
+//
+void
+pmap_discard(pde_t *pdir, uint32_t va, size_t size)
+{
+	assert(PGOFF(va) == 0);
+	assert(PGOFF(size) == 0);
+	assert(va >= VM_USERLO && va < VM_USERHI);
+	assert(size <= VM_USERHI - va);
+
+	pmap_inval(pdir, va, size);
+
+	uint32_t end = va + size;
+	while (va < end) {
+		pte_t *pte = pmap_walk(pdir, va, false);
+		if (pte == NULL) {	// nothing mapped in this page table
+			va = ROUNDDOWN(va, PTSIZE) + PTSIZE;
+			continue;
+		}
+
+		// A writable page has lost its nominal permission bits
+		// to pmap_pagefault; it was readable and writable.
+		uint32_t perm = *pte & SYS_RW;
+		if ((*pte & PTE_P) && (*pte & PTE_W) && !PTE_SHARED(*pte))
+			perm = SYS_RW;
+		if (perm & SYS_READ)
+			perm |= PTE_P | PTE_U;
+
+		// Remote references have no local page to release.
+		uint32_t pa = PGADDR(*pte);
+		if (PTE_LOCAL(*pte) && pa != PTE_ZERO)
+			mem_decref(mem_phys2pi(pa), mem_free);
+		*pte = PTE_ZERO | perm;
+		va += PAGESIZE;
+	}
+}
+
 //
 // Transparently handle a page fault entirely in the kernel, if possible.
 // If the page fault was caused by a write to a copy-on-write page,
@@ -421,7 +748,24 @@ pmap_pagefault(trapframe *tf)
 	proc *p = proc_cur();
 	pmap_inval(p->pdir, fva, PAGESIZE);
 	pde_t *pde = p->pdir;
+
+	// A migrated process pulls its page tables and pages on demand:
+	// fetch whichever of them is still on another node
+	// (blocking until it arrives if need be) and retry the access,
+	// pulling ahead the ones that follow it in the same table.
+	if (!PTE_LOCAL(pde[PDX(fva)])) {
+		if (!(tf->cs & 3))
+			return;		// kernel code must net_localize first
+		net_fetch(tf, -1, &pde[PDX(fva)], PGLEV_PTAB,
+				PDX(VM_USERHI) - 1 - PDX(fva));
+	}
 	pte_t *pte = pmap_walk(pde, fva, 1);
+	if (pte && !PTE_LOCAL(*pte)) {
+		if (!(tf->cs & 3))
+			return;
+		net_fetch(tf, -1, pte, PGLEV_PAGE, NPTENTRIES - 1 - PTX(fva));
+		trap_return(tf);
+	}
 	
 	pte_t oldpte = *pte;
 	
@@ -432,21 +776,22 @@ pmap_pagefault(trapframe *tf)
 	}
 
 	uint32_t permissions = PGOFF(*pte);
-	pageinfo *pi = mem_phys2pi(PGADDR(*pte));
 	if (!(permissions & PTE_W) && (permissions & SYS_WRITE)) {
-		if (mem_pi2phys(pi) == PTE_ZERO || pi->refcount > 1) {
-			//cprintf("copying on write - new\n");
-			pageinfo *pi_new = mem_alloc();
-			pi_new->refcount = 1;
-			memmove(mem_pi2ptr(pi_new), (void *) PGADDR(*pte), PAGESIZE);
-			if (PGADDR(*pte) != PTE_ZERO)
-				mem_decref(mem_phys2pi(PGADDR(*pte)), mem_free);
-			*pte = mem_pi2phys(pi_new);
-			assert(*pte != oldpte);
-		}// else cprintf("copying on write - old\n");
-		
-		permissions = (permissions | PTE_W | PTE_P) & ~SYS_RW;
-		*pte = PGADDR(*pte) | permissions;
+		if (!pmap_ownpage(pte))
+			panic("pmap_pagefault: out of memory");
+		assert(*pte != oldpte);
+		net_dirty(p, fva, 1);
+
+		// Fill in the pages after this one ahead of time
+		// if the process said it writes this region sequentially.
+		// Never mind if we run out of memory doing so.
+		uint32_t va = PGADDR(fva) + PAGESIZE;
+		if (fva >= p->seqlo && fva < p->seqhi && va < p->seqhi) {
+			size_t size = MIN(p->seqhi - va,
+					(PMAP_FAULTAROUND - 1) * PAGESIZE);
+			pmap_populate(p->pdir, va, size);
+			net_dirty(p, va, size);
+		}
 		trap_return(tf);
 	}// else cprintf("won't copy on write coz - %d , %d\n", !(permissions & PTE_W), (permissions & SYS_WRITE));
 
@@ -458,7 +803,8 @@ pmap_pagefault(trapframe *tf)
 		trap_return(tf);
 	}
 	
-	cprintf("pmap_pagefault - permissions not good %d %d\n", (permissions & PTE_W), (permissions & SYS_WRITE));
+	if (!p->sv.pfeip)	// quiet if the process handles its own faults
+		cprintf("pmap_pagefault - permissions not good %d %d\n", (permissions & PTE_W), (permissions & SYS_WRITE));
 	return;
 	//proc_ret(tf, 1);
 }
@@ -552,6 +898,11 @@ pmap_merge(pde_t *rpdir, pde_t *spdir, uint32_t sva,
 			
 			//Skip same entries
 			if (*spte == *rpte && *dpte == *rpte) continue;
+
+			//Shared pages already hold everyone's writes
+			if (PTE_SHARED(*spte) || PTE_SHARED(*rpte) ||
+			    PTE_SHARED(*dpte))
+				continue;
 			
 			//If changed only at source, copy on write
 			if (*dpte == *rpte && *spte != *rpte){
@@ -17,6 +17,7 @@
 #include <inc/assert.h>
 #include <inc/mmu.h>
 #include <inc/vm.h>
+#include <inc/syscall.h>
 
 #include <kern/mem.h>
 
@@ -43,8 +44,25 @@ extern uint8_t pmap_zero[PAGESIZE];
 // instead the page fault handler creates copies of the zero page on demand.
 #define PTE_ZERO	((uint32_t)pmap_zero)
 
+// A page mapped writably shared with SYS_SHARE (see inc/syscall.h)
+// has the SYS_SHARE bit set in its PTE.  That bit doubles as PTE_REMOTE
+// in remote references (kern/net.h), but those never have PTE_P set.
+#define PTE_SHARED(pte)	(((pte) & (SYS_SHARE | PTE_P)) == (SYS_SHARE | PTE_P))
+
+// Any other PTE with that bit and without PTE_P is a remote reference,
+// with no local page behind it to reference-count.
+#define PTE_LOCAL(pte)	(((pte) & PTE_P) || !((pte) & SYS_SHARE))
+
+
+// Number of clean page directories each CPU keeps on hand.
+#define PMAP_PDIRPOOL	8
+
+// Pages the fault handler populates after a write fault
+// in a process's SYS_SEQUENTIAL region, including the faulting page.
+#define PMAP_FAULTAROUND	16
 
 void pmap_init(void);
+void pmap_fillpool(void);
 pte_t *pmap_newpdir(void);
 void pmap_freepdir(pageinfo *pdirpi);
 void pmap_freeptab(pageinfo *ptabpi);
@@ -54,6 +72,13 @@ void pmap_remove(pde_t *pdir, uint32_t uva, size_t size);
 void pmap_inval(pde_t *pdir, uint32_t uva, size_t size);
 int pmap_copy(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
 		size_t size);
+int pmap_sync(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
+		size_t size);
+int pmap_share(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
+		size_t size);
+int pmap_populate(pde_t *pdir, uint32_t va, size_t size);
+void pmap_discard(pde_t *pdir, uint32_t va, size_t size);
+void pmap_cowshared(pde_t *pdir, uint32_t va, size_t size);
 int pmap_merge(pde_t *rpdir, pde_t *spdir, uint32_t sva,
 		pde_t *dpdir, uint32_t dva, size_t size);
 int pmap_setperm(pde_t *pdir, uint32_t va, uint32_t size, int perm);
@@ -17,6 +17,10 @@
 #include <kern/init.h>
 #include <kern/file.h>
 #include <kern/net.h>
+#include <kern/mp.h>
+#include <kern/pmap.h>
+
+#include <dev/lapic.h>
 
 
 
@@ -28,8 +32,25 @@ proc *proc_root;	// root process, once it's created in init()
 
 proc *proc_head;
 proc *proc_tail;
+int proc_nready;	// Number of processes on the ready queue
 struct spinlock proc_lock;
 
+// Virtual time: the pass of the process most recently dequeued to run.
+// Newly ready processes start no earlier than this,
+// so that sleeping doesn't let a process hoard credit.
+uint64_t proc_vtime;
+
+// How far ahead of everyone else a process waking from I/O is queued.
+#define PROC_BOOST	(lapic_quantum)
+
+bool proc_gang = PROC_GANG;
+spinlock proc_ganglock;	// Protects all procgang state; never held long
+
+// Torn-down proc structs waiting to be reused, chained through readynext.
+// Proc pages are never returned to the page allocator,
+// because other CPUs may still hold stale FPU-owner pointers to them.
+proc *proc_pool;
+
 void
 proc_init(void)
 {
@@ -38,6 +59,7 @@ proc_init(void)
 
 	// your module initialization code here
 	spinlock_init(&proc_lock);
+	spinlock_init(&proc_ganglock);
 	proc_head = proc_tail = NULL;
 }
 
@@ -46,38 +68,43 @@ proc_init(void)
 proc *
 proc_alloc(proc *p, uint32_t cn)
 {
-	pageinfo *pi = mem_alloc();
-	if (!pi)
-		return NULL;
-	mem_incref(pi);
-	
-	proc *cp = (proc*)mem_pi2ptr(pi);
+	spinlock_acquire(&proc_lock);
+	proc *cp = proc_pool;
+	if (cp)
+		proc_pool = cp->readynext;
+	spinlock_release(&proc_lock);
+
+	if (!cp) {
+		pageinfo *pi = mem_alloc();
+		if (!pi)
+			return NULL;
+		mem_incref(pi);
+		cp = (proc*)mem_pi2ptr(pi);
+	}
 	memset(cp, 0, sizeof(proc));
 	spinlock_init(&cp->lock);
 	cp->parent = p;
+	cp->childno = cn;
 	cp->state = PROC_STOP;
+	cp->sv.weight = p ? p->sv.weight : PROC_WEIGHT;
 
 
 	cp->home = RRCONS(net_node, mem_phys(cp), 0);
 	
-	//Page directories - we might need this stuff, idk, merge conflict
-	// cp->pdir = pmap_newpdir();
-	// cp->rpdir = pmap_newpdir();
-
 	// Integer register state
 	cp->sv.tf.ds = CPU_GDT_UDATA | 3;
 	cp->sv.tf.es = CPU_GDT_UDATA | 3;
 	cp->sv.tf.cs = CPU_GDT_UCODE | 3;
 	cp->sv.tf.ss = CPU_GDT_UDATA | 3;
 
+	// The reference page directory is only needed for SYS_MERGE,
+	// so it is allocated lazily by the first SYS_SNAP.
 	cp->pdir = pmap_newpdir();
-	if (!cp->pdir)
-		return NULL;
-
-	cp->rpdir = pmap_newpdir();
-	if (!cp->rpdir)
-	{
-		pmap_freepdir(mem_ptr2pi(cp->pdir));
+	if (!cp->pdir) {
+		spinlock_acquire(&proc_lock);
+		cp->readynext = proc_pool;
+		proc_pool = cp;
+		spinlock_release(&proc_lock);
 		return NULL;
 	}
 
@@ -86,6 +113,73 @@ proc_alloc(proc *p, uint32_t cn)
 	return cp;
 }
 
+// Returns true if 'cp' and all its descendants can be torn down:
+// they must all be stopped and local, and never shared with other nodes,
+// since remote nodes may still hold references to their proc structs.
+// Nor may they have page pulls still in flight (see net_fetch).
+static bool
+proc_freeable(proc *cp)
+{
+	if (cp->state != PROC_STOP || RRNODE(cp->home) != net_node
+			|| mem_ptr2pi(cp)->shared != 0 || cp->npull != 0)
+		return false;
+	int i;
+	for (i = 0; i < PROC_CHILDREN; i++)
+		if (cp->child[i] && !proc_freeable(cp->child[i]))
+			return false;
+	return true;
+}
+
+// Release 'cp', its descendants, and their page directories and snapshots,
+// returning the proc structs to proc_pool.
+static void
+proc_release(proc *cp)
+{
+	int i;
+	for (i = 0; i < PROC_CHILDREN; i++)
+		if (cp->child[i])
+			proc_release(cp->child[i]);
+
+	mem_decref(mem_ptr2pi(cp->pdir), pmap_freepdir);
+	if (cp->rpdir)
+		mem_decref(mem_ptr2pi(cp->rpdir), pmap_freepdir);
+	cp->fpucpu = NULL;	// make any CPU's cached FPU pointer stale
+	cp->fpudirty = 0;
+
+	spinlock_acquire(&proc_lock);
+	cp->readynext = proc_pool;
+	proc_pool = cp;
+	spinlock_release(&proc_lock);
+}
+
+// Tear down child 'cn' of process 'p', which must be stopped,
+// and make the child slot available for a fresh proc_alloc().
+// If some descendant is still active or has been shared with another node,
+// we can only release the child's address space, as SYS_ZERO would.
+void
+proc_free(proc *p, uint32_t cn)
+{
+	proc *cp = p->child[cn];
+	if (cp == NULL)
+		return;
+	assert(cp->state == PROC_STOP);
+
+	// Like reaping a child in Unix, fold its usage into ours.
+	p->cru.utime += cp->ru.utime + cp->cru.utime;
+	p->cru.stime += cp->ru.stime + cp->cru.stime;
+	p->cru.nswitch += cp->ru.nswitch + cp->cru.nswitch;
+	p->cru.nsyscall += cp->ru.nsyscall + cp->cru.nsyscall;
+	memset(&cp->ru, 0, sizeof(cp->ru));
+	memset(&cp->cru, 0, sizeof(cp->cru));
+
+	if (!proc_freeable(cp)) {
+		pmap_remove(cp->pdir, VM_USERLO, VM_USERHI-VM_USERLO);
+		return;
+	}
+	p->child[cn] = NULL;
+	proc_release(cp);
+}
+
 // Put process p in the ready state and add it to the ready queue.
 void
 proc_ready(proc *p)
@@ -99,15 +193,143 @@ proc_ready(proc *p)
 	spinlock_release(&p->lock);
 
 	spinlock_acquire(&proc_lock);
+
+	// A process waking from I/O goes to the front of the line;
+	// anyone else may not start behind the current virtual time.
+	if (p->boost) {
+		p->boost = 0;
+		p->pass = proc_vtime > PROC_BOOST ? proc_vtime - PROC_BOOST : 0;
+	} else if (p->pass < proc_vtime)
+		p->pass = proc_vtime;
 	
-	// I changed this, I think it was buggy -Ivan
-	if (proc_head && proc_tail){
-		proc_tail->readynext = p;
-		proc_tail = p;
-	} else
-		proc_tail = proc_head = p;
+	// Queue gang members right behind their queued siblings,
+	// so that the whole gang is picked up by CPUs at about the same time.
+	// Otherwise keep the queue sorted by pass, FIFO among equals.
+	proc *q = NULL, *r;
+	if (p->ganglead)
+		for (r = proc_head; r; r = r->readynext)
+			if (r->ganglead == p->ganglead)
+				q = r;
+	if (q == NULL)
+		for (r = proc_head; r && r->pass <= p->pass; r = r->readynext)
+			q = r;
+
+	if (q) {
+		p->readynext = q->readynext;
+		q->readynext = p;
+		if (proc_tail == q)
+			proc_tail = p;
+	} else {
+		p->readynext = proc_head;
+		proc_head = p;
+		if (proc_tail == NULL)
+			proc_tail = p;
+	}
 
+	proc_nready++;
 	spinlock_release(&proc_lock);
+
+	// Someone is now waiting, so every CPU must preempt what it runs.
+	// This CPU may have stopped its timer, so tick periodically again.
+	// A CPU whose one-shot quantum fired while nobody was waiting
+	// let its process go on with no timer at all (see trap()):
+	// give it a timer interrupt now, so that it yields and re-arms.
+	// Idle CPUs keep polling the ready queue by themselves.
+	lapic_periodic(lapic_quantum);
+	cpu *c;
+	for (c = &cpu_boot; c; c = c->next)
+		if (c != cpu_cur() && c->timer == 0) {
+			c->timer = T_LTIMER;	// kick it just once
+			lapic_kick(c->id);
+		}
+}
+
+// Make a process ready that has been waiting for I/O,
+// giving it a latency boost over CPU-bound processes.
+void
+proc_wake(proc *p)
+{
+	p->boost = 1;
+	proc_ready(p);
+}
+
+// Start child 'cp' of 'p' as a member of p's gang, if gang mode is on.
+void
+proc_gangstart(proc *p, proc *cp)
+{
+	if (!proc_gang || cp->ganglead == p)
+		return;
+	spinlock_acquire(&proc_ganglock);
+	procgang *g = &p->gang;
+	if (g->nrun++ == 0) {
+		g->size = 0;
+		g->start = rdtsc();
+		g->first = 0;
+		g->slice = 0;
+	}
+	g->size++;
+	cp->ganglead = p;
+	spinlock_release(&proc_ganglock);
+}
+
+// Gang member 'cp' is returning to its parent: account for it,
+// and record the gang's makespan and skew when its last member is done.
+static void
+proc_gangdone(proc *cp)
+{
+	proc *p = cp->ganglead;
+	spinlock_acquire(&proc_ganglock);
+	procgang *g = &p->gang;
+	uint64_t now = rdtsc();
+	if (g->first == 0)
+		g->first = now;
+	cp->ganglead = NULL;
+	if (--g->nrun > 0) {
+		spinlock_release(&proc_ganglock);
+		return;
+	}
+	if (g->size > 1) {	// a lone child restarted by waitpid() is no gang
+		g->count++;
+		g->makespan += now - g->start;
+		g->skew += now - g->first;
+	}
+	spinlock_release(&proc_ganglock);
+}
+
+// Return how many microseconds gang member 'p' may run for:
+// what is left of the gang's shared slice, or a fresh slice
+// if that one has expired or is nearly used up.
+static uint32_t
+proc_gangslice(proc *p)
+{
+	spinlock_acquire(&proc_ganglock);
+	procgang *g = &p->ganglead->gang;
+	uint64_t now = rdtsc();
+	uint64_t min = (uint64_t)lapic_quantum / 4 * lapic_tscpu;
+	if (g->slice < now + min)
+		g->slice = now + (uint64_t)lapic_quantum * lapic_tscpu;
+	uint32_t us = (g->slice - now) / lapic_tscpu;
+	spinlock_release(&proc_ganglock);
+	return us;
+}
+
+// Program this CPU's timer for what it is about to do.
+// Periodic preemption is only needed when other processes are waiting;
+// a process running alone gets a single one-shot quantum,
+// and an idle CPU needs no timer interrupts at all.
+// Gang members always get a one-shot for the rest of their gang's slice.
+// The boot CPU keeps ticking while net_tick() has retransmissions to do.
+static void
+proc_timer(proc *p)
+{
+	if (p != NULL && p->ganglead != NULL)
+		lapic_oneshot(proc_gangslice(p));
+	else if (proc_head != NULL || (cpu_onboot() && net_pending()))
+		lapic_periodic(lapic_quantum);
+	else if (p != NULL)
+		lapic_oneshot(lapic_quantum);
+	else
+		lapic_stop();
 }
 
 // Save the current process's state before switching to another process.
@@ -124,11 +346,156 @@ proc_save(proc *p, trapframe *tf, int entry)
 	p->sv.tf = *tf;
 	if (!entry) {
 			p->sv.tf.eip -= 2;
+			// Back up onto the INT or SYSENTER (both 2 bytes long),
+			// which must be re-executed with all registers intact.
+			if (p->sv.tf.err == SYSENTER_ERR)
+				p->sv.tf.err = 0;
+	}
+
+	// Charge kernel time since our last kernel entry.
+	uint64_t now = rdtsc();
+	if (p->tstamp) {
+		p->ru.stime += now - p->tstamp;
+		p->tstamp = 0;
+	}
+
+	// Charge the CPU time p just used against its weight.
+	if (p->runstart) {
+		uint64_t us = (rdtsc() - p->runstart) / lapic_tscpu;
+		p->pass += us * PROC_WEIGHT / p->sv.weight;
+		p->runstart = 0;
+	}
+
+	// On a uniprocessor we leave the FPU state in the registers
+	// until some other process claims the FPU (see proc_fpuload).
+	// On a multiprocessor another CPU may pick p up next,
+	// so its FPU state can't be left behind on this one.
+	if (p->fpudirty && ncpu > 1)
+		proc_fpusave(p);
+}
+
+// Called from trap() on every entry from user mode:
+// the time since we last left the kernel was spent in user mode.
+void
+proc_kenter(void)
+{
+	proc *p = proc_cur();
+	if (p == NULL || p->tstamp == 0)
+		return;
+	uint64_t now = rdtsc();
+	p->ru.utime += now - p->tstamp;
+	p->tstamp = now;
+}
+
+// Called from trap_return() whenever it returns to user mode:
+// the time since we entered the kernel (or were scheduled) was kernel time.
+void
+proc_kleave(void)
+{
+	proc *p = proc_cur();
+	if (p == NULL || p->tstamp == 0)
+		return;
+	uint64_t now = rdtsc();
+	p->ru.stime += now - p->tstamp;
+	p->tstamp = now;
+}
+
+static void
+proc_usage2us(procusage *us, const procusage *ticks)
+{
+	us->utime = ticks->utime / lapic_tscpu;
+	us->stime = ticks->stime / lapic_tscpu;
+	us->nswitch = ticks->nswitch;
+	us->nsyscall = ticks->nsyscall;
+}
+
+static void
+proc_usage2ticks(procusage *ticks, const procusage *us)
+{
+	ticks->utime = us->utime * lapic_tscpu;
+	ticks->stime = us->stime * lapic_tscpu;
+	ticks->nswitch = us->nswitch;
+	ticks->nsyscall = us->nsyscall;
+}
+
+// Report p's resource usage and the statistics on its children's gangs
+// in microseconds in its save area,
+// for a parent's GET or for p's migration to another node.
+void
+proc_getusage(proc *p)
+{
+	proc_usage2us(&p->sv.ru, &p->ru);
+	proc_usage2us(&p->sv.cru, &p->cru);
+
+	spinlock_acquire(&proc_ganglock);
+	p->sv.gang.count = p->gang.count;
+	p->sv.gang.makespan = p->gang.makespan / lapic_tscpu;
+	p->sv.gang.skew = p->gang.skew / lapic_tscpu;
+	spinlock_release(&proc_ganglock);
+}
+
+// Take over the resource usage and gang statistics p accumulated
+// on another node.
+void
+proc_setusage(proc *p)
+{
+	proc_usage2ticks(&p->ru, &p->sv.ru);
+	proc_usage2ticks(&p->cru, &p->sv.cru);
+
+	spinlock_acquire(&proc_ganglock);
+	p->gang.count = p->sv.gang.count;
+	p->gang.makespan = p->sv.gang.makespan * lapic_tscpu;
+	p->gang.skew = p->sv.gang.skew * lapic_tscpu;
+	spinlock_release(&proc_ganglock);
+}
+
+// Initial FPU state for processes that have not used the FPU yet:
+// all x87 exceptions masked, and the default SSE control/status word.
+static fxsave proc_fpuinit = { .fcw = 0x037f, .mxcsr = 0x1f80 };
+
+// Give process 'p' the FPU in response to a device-not-available trap:
+// save the previous owner's state if it is still only in the registers,
+// then load p's state, or a clean state if this is p's first FPU use.
+void
+proc_fpuload(proc *p)
+{
+	cpu *c = cpu_cur();
+	clts();
+	if (c->fpu != p || p->fpucpu != c) {
+		proc *op = c->fpu;
+		if (op && op->fpucpu == c && op->fpudirty) {
+			asm volatile("fxsave %0" : "=m" (op->sv.fx));
+			op->fpudirty = 0;
+		}
+		if (p->sv.pff & PFF_USEFPU)
+			asm volatile("fxrstor %0" : : "m" (p->sv.fx));
+		else
+			asm volatile("fxrstor %0" : : "m" (proc_fpuinit));
+		c->fpu = p;
+		p->fpucpu = c;
 	}
-	//we need to implement this correctly for blocking and stuff like that
+	p->sv.pff |= PFF_USEFPU;
+	p->fpudirty = 1;
 }
 
-// Go to sleep waiting for a given child process to finish running.
+// Make sure p->sv.fx is up to date, e.g., before a parent reads it
+// or p migrates.  If p's registers are newer than its save area,
+// they can only be live in this CPU's FPU (see proc_save).
+void
+proc_fpusave(proc *p)
+{
+	if (!p->fpudirty)
+		return;
+	assert(p->fpucpu == cpu_cur());
+	clts();
+	asm volatile("fxsave %0" : "=m" (p->sv.fx));
+	lcr0(rcr0() | CR0_TS);
+	p->fpudirty = 0;
+}
+
+// Go to sleep waiting for a given child process to finish running,
+// or with cp == NULL, for all p->waitn children marked batchwait if nonzero,
+// or else for any child in the range p->waitlo..p->waithi.
 // Parent process 'p' must be running and locked on entry.
 // The supplied trapframe represents p's register state on syscall entry.
 void gcc_noreturn
@@ -148,8 +515,12 @@ void gcc_noreturn
 proc_sched(void)
 {
 	spinlock_acquire(&proc_lock);
+	if (proc_head == NULL)	// don't idle on a pdir that may be freed
+		lcr3(mem_phys(pmap_bootpdir));
 	while (proc_head == NULL) {
 		spinlock_release(&proc_lock);
+		proc_timer(NULL);
+		pmap_fillpool();
 		sti(); //Enable kbd interrupts
 		pause();
 		cli(); //Disable kbd interrupts
@@ -160,6 +531,9 @@ proc_sched(void)
 	proc_head = p->readynext;
 	if (proc_head == NULL)
 		proc_tail = NULL;
+	proc_nready--;
+	if (p->pass > proc_vtime)
+		proc_vtime = p->pass;
 
 	spinlock_acquire(&p->lock);
 	spinlock_release(&proc_lock);
@@ -177,7 +551,10 @@ proc_run(proc *p)
 	
 	p->state = PROC_RUN;
 	p->runcpu = cpu_cur();
-	cpu_cur()->proc = p;
+	p->runstart = rdtsc();
+	p->tstamp = p->runstart;
+	p->ru.nswitch++;
+	cpu_set(proc, p);
 	
 	// Enable interrupts (for preemption)
 	p->sv.tf.eflags |= (1 << 9);
@@ -186,6 +563,16 @@ proc_run(proc *p)
 	p->sv.tf.cs = CPU_GDT_UCODE | 3;
 	p->sv.tf.ss = CPU_GDT_UDATA | 3;
 	lcr3 (mem_phys(p->pdir));
+	proc_timer(p);
+
+	// Let p use the FPU without trapping only if this CPU's FPU
+	// still holds p's state; otherwise trap on its first FPU use.
+	cpu *c = cpu_cur();
+	if (c->fpu == p && p->fpucpu == c) {
+		clts();
+		p->fpudirty = 1;
+	} else
+		lcr0(rcr0() | CR0_TS);
 	
 	spinlock_release(&p->lock);
 	
@@ -223,14 +610,27 @@ proc_ret(trapframe *tf, int entry)
 		cprintf("fileio done\n");
 	}
 
+	// Account for a finished gang member before its parent can see it stop.
+	if (cp->ganglead)
+		proc_gangdone(cp);
+
 	spinlock_acquire(&cp->lock);
 	cp->state = PROC_STOP;
+	cp->stopped = 1;
 	cp->runcpu = NULL;
 	proc_save(cp, tf, entry);
 	spinlock_release(&cp->lock);
 	
 	spinlock_acquire(&p->lock);
-	if (p->state == PROC_WAIT && p->waitchild == cp) {
+	bool wake;
+	if (cp->batchwait) {		// wake only when the whole batch stops
+		cp->batchwait = 0;
+		wake = --p->waitn == 0;
+	} else
+		wake = p->waitchild == cp || (p->waitchild == NULL &&
+			p->waitn == 0 && cp->childno >= p->waitlo &&
+			cp->childno <= p->waithi);
+	if (p->state == PROC_WAIT && wake) {
 		p->waitchild = NULL;
 		proc_run(p);
 	}
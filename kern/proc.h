@@ -18,6 +18,7 @@
 
 #include <kern/spinlock.h>
 #include <kern/pmap.h>
+#include <kern/net.h>
 #include <inc/file.h>
 
 typedef enum proc_state {
@@ -30,6 +31,28 @@ typedef enum proc_state {
 	PROC_PULL,		// Migrated to another node
 } proc_state;
 
+// Gang scheduling is off by default; build with DEFS=-DPROC_GANG=1 to enable.
+// In gang mode, the children a process starts form a gang:
+// they are queued together, so idle CPUs pick them up at the same time,
+// and they share a single time slice so they are preempted together.
+#ifndef PROC_GANG
+#define PROC_GANG	0
+#endif
+
+// Per-parent gang state and statistics.  Times are in TSC ticks.
+// The statistics cover gangs of more than one member,
+// and a GET with SYS_REGS reports them in the procstate.
+typedef struct procgang {
+	int		nrun;		// Members started and not yet returned
+	int		size;		// Members started in the current gang
+	uint64_t	start;		// When the first member was started
+	uint64_t	first;		// When the first member returned
+	uint64_t	slice;		// When the gang's current time slice ends
+	uint32_t	count;		// Number of gangs completed
+	uint64_t	makespan;	// Total start-to-last-return time
+	uint64_t	skew;		// Total first-to-last-return time
+} procgang;
+
 // Thread control block structure.
 // Consumes 1 physical memory page, though we don't use all of it.
 typedef struct proc {
@@ -46,30 +69,57 @@ typedef struct proc {
 	struct proc	*readynext;	// chain on ready queue
 	struct cpu	*runcpu;	// cpu we're running on if running
 	struct proc	*waitchild;	// child proc if waiting for child
+	uint8_t		waitlo;		// Range of children if waiting for
+	uint8_t		waithi;		// any of them (waitchild == NULL)
+	uint8_t		childno;	// Our index in parent's child array
+	bool		stopped;	// Stopped since parent last got from us
+	int		waitn;		// Batch children we're waiting for
+	bool		batchwait;	// Parent is waiting for us in a batch
+
+	// CPU time accounting, in TSC ticks until reported in sv.ru/sv.cru.
+	procusage	ru;		// Our own usage
+	procusage	cru;		// Total usage of our freed descendants
+	uint64_t	tstamp;		// When we last entered or left the kernel
+
+	// Weighted fair scheduling state: the ready queue is kept sorted
+	// by pass, the CPU time we've used scaled inversely by sv.weight.
+	uint64_t	pass;		// Weighted virtual CPU time, in us
+	uint64_t	runstart;	// TSC when we last started running
+	bool		boost;		// Waking from I/O: jump the queue
+
+	// Gang scheduling state (see PROC_GANG above).
+	struct proc	*ganglead;	// Parent whose gang we're running in
+	procgang	gang;		// Gang of our own children
 
 	// Save area for user-visible state when process is not running.
 	procstate	sv;
 
+	// Lazy FPU state: the CPU whose FPU registers last held our state,
+	// and whether those registers may be newer than sv.fx.
+	struct cpu	*fpucpu;
+	bool		fpudirty;
+
 	// Virtual memory state for this process.
 	pde_t		*pdir;		// Working page directory
 	pde_t		*rpdir;		// Reference page directory
+	uint32_t	seqlo;		// Fault-around region (SYS_SEQUENTIAL)
+	uint32_t	seqhi;
 
 	// Network and process migration state.
 	uint32_t	home;		// RR to proc's home node and addr
 	uint32_t	rrpdir;		// RR to migration source's page dir
 	uint8_t		migrdest;	// Destination we're migrating to
 	struct proc	*migrnext;	// Next on list of migrating procs
+	uint32_t	dirty[NPDENTRIES/32]; // 4MB regions changed away from home
 
 	// Remote reference pulling state.
 	struct proc	*pullnext;	// Next on list of page-pulling procs
-	uint32_t	pullva;		// Where we are pulling in our addr spc
-	uint32_t	pullrr;		// Current RR we are pulling
-	void		*pullpg;	// Local page we are pulling into
-	uint8_t		pglev;		// Level: 0=page, 1=page table, 2=pdir
-	uint8_t		arrived;	// Bits 0-2: which parts have arrived
+	net_pullslot	pull[NET_PULLWIN]; // Window of pulls in flight
+	int		npull;		// Number of pull slots in use
+	net_pullslot	*pullwait;	// Pull we're waiting for in PROC_PULL
 } proc;
 
-#define proc_cur()	(cpu_cur()->proc)
+#define proc_cur()	cpu_get(proc)
 
 
 // Special "null process" - always just contains zero in all fields.
@@ -78,11 +128,29 @@ extern proc proc_null;
 // Special root process - the only one that can do direct external I/O.
 extern proc *proc_root;
 
+// Head of the ready queue: non-NULL if any process is waiting to run.
+extern proc *proc_head;
+
+// Number of processes on the ready queue, for the kernel info page.
+extern int proc_nready;
+
+// True if gang scheduling is enabled.
+extern bool proc_gang;
+
 
 void proc_init(void);	// Initialize process management code
 proc *proc_alloc(proc *p, uint32_t cn);	// Allocate new child
 void proc_ready(proc *p);	// Make process p ready
+void proc_wake(proc *p);	// Make p ready after an I/O wait
+void proc_free(proc *p, uint32_t cn);	// tear down child cn of p
+void proc_gangstart(proc *p, proc *cp);	// add cp to p's gang
 void proc_save(proc *p, trapframe *tf, int entry);	// save process state
+void proc_fpuload(proc *p);	// give p the FPU after a T_DEVICE trap
+void proc_fpusave(proc *p);	// write p's live FPU registers to p->sv.fx
+void proc_kenter(void);		// charge user time on entry from user mode
+void proc_kleave(void);		// charge kernel time on return to user mode
+void proc_getusage(proc *p);	// report p's usage in p->sv.ru and sv.cru
+void proc_setusage(proc *p);	// reload p's usage from p->sv.ru and sv.cru
 void proc_wait(proc *p, proc *cp, trapframe *tf) gcc_noreturn;
 void proc_sched(void) gcc_noreturn;	// Find and run some ready process
 void proc_run(proc *p) gcc_noreturn;	// Run a specific process
@@ -69,6 +69,17 @@ static void checkva(trapframe *utf, uint32_t uva, size_t size)
 	}
 }
 
+// Abort a GET or PUT that ran out of memory partway through changing
+// the mappings of 'size' bytes at 'va' in process 'p',
+// by sending a T_PGFLT to the parent as for an unusable address.
+// Whatever it already changed stays changed, so note it as changed.
+static void gcc_noreturn
+sysnomem(trapframe *utf, proc *p, uint32_t va, size_t size)
+{
+	net_dirty(p, va, size);
+	systrap(utf, T_PGFLT, 0);
+}
+
 // Copy data to/from user space,
 // using checkva() above to validate the address range
 // and using sysrecover() to recover from any traps during the copy.
@@ -76,6 +87,7 @@ void usercopy(trapframe *utf, bool copyout,
 			void *kva, uint32_t uva, size_t size)
 {
 	checkva(utf, uva, size);
+	net_localize(utf, 0, proc_cur()->pdir, uva, size, 1);
 
 	cpu *cp = cpu_cur();
 	void *temp = cp->recover;
@@ -100,6 +112,22 @@ do_cputs(trapframe *tf, uint32_t cmd)
 	//cprintf("cputs\n");
 	// Print the string supplied by the user: pointer in EBX
 	char buf[CPUTS_MAX + 1];
+	if (cmd & SYS_LEN) {
+		// Copy just the ECX bytes asked for, a bufferful at a time,
+		// and hand each bufferful to the console as one write.
+		uint32_t va = tf->regs.ebx;
+		size_t len = tf->regs.ecx;
+		checkva(tf, va, len);
+		net_localize(tf, 0, proc_cur()->pdir, va, len, 1);
+		while (len > 0) {
+			size_t n = MIN(len, sizeof(buf));
+			usercopy(tf, 0, buf, va, n);
+			cwrite(buf, n);
+			va += n;
+			len -= n;
+		}
+		trap_return(tf);
+	}
 	usercopy(tf, 0,  buf, tf->regs.ebx, CPUTS_MAX);
 	buf[CPUTS_MAX] = 0;
 	cprintf("%s", buf);
@@ -108,6 +136,235 @@ do_cputs(trapframe *tf, uint32_t cmd)
 	trap_return(tf);	// syscall completed
 }
 
+// Share 'size' bytes of memory at 'sva' in process 'sp' writably
+// with 'dva' in process 'dp', which only a process with PFF_NONDET may do.
+static void
+do_share(trapframe *tf, proc *p, proc *sp, uint32_t sva,
+		proc *dp, uint32_t dva, size_t size)
+{
+	if (!(p->sv.pff & PFF_NONDET) || PGOFF(sva | dva | size) != 0)
+		systrap(tf, T_GPFLT, 0);
+	checkva(tf, sva, size);
+	checkva(tf, dva, size);
+	if (!pmap_share(sp->pdir, sva, dp->pdir, dva, size)) {
+		net_dirty(sp, sva, size);
+		sysnomem(tf, dp, dva, size);
+	}
+}
+
+// Apply the SYS_ADVICE flags in 'flags' to 'size' bytes at 'va'
+// in process 'ap', whose memory is the destination of a GET or PUT.
+static void
+do_advise(trapframe *tf, proc *ap, uint32_t flags, uint32_t va, size_t size)
+{
+	if (PGOFF(va | size) != 0)
+		systrap(tf, T_GPFLT, 0);
+	checkva(tf, va, size);
+	if (flags & SYS_DONTNEED)
+		pmap_discard(ap->pdir, va, size);
+	if ((flags & SYS_WILLNEED) && !pmap_populate(ap->pdir, va, size))
+		sysnomem(tf, ap, va, size);	// pages done so far are fine
+	if (flags & SYS_SEQUENTIAL) {
+		ap->seqlo = va;
+		ap->seqhi = va + size;
+	}
+}
+
+// Perform the memory operation and permission change in 'flags' for a PUT,
+// on 'size' bytes from local 'sva' to the child's 'dva'.
+static void
+do_putmem(trapframe *tf, proc *p, proc *cp, uint32_t flags,
+		uint32_t sva, uint32_t dva, size_t size)
+{
+	// handle memory flags
+	uint32_t memop = flags & SYS_MEMOP;
+
+	if (memop == SYS_SYNC) {
+		if (PTOFF(sva | dva | size) != 0)
+			systrap(tf, T_GPFLT, 0);
+		checkva(tf, sva, size);
+		checkva(tf, dva, size);
+		if (!pmap_sync(p->pdir, sva, cp->pdir, dva, size))
+			sysnomem(tf, cp, dva, size);
+	} else if (memop & SYS_ZERO) {
+		checkva(tf, dva, size);
+		pmap_remove(cp->pdir, dva, size);
+	} else if (memop & SYS_COPY) {
+		checkva(tf, sva, size);
+		checkva(tf, dva, size);
+		pmap_copy(p->pdir, sva, cp->pdir, dva, size);
+	}
+	if (flags & SYS_SHARE)
+		do_share(tf, p, p, sva, cp, dva, size);
+
+	// handle permission changes
+	//uint32_t perms = flags & SYS_PERM;
+	//flags cpdir childdest(dva) sz
+	if (flags & SYS_PERM) {
+		int nom_perm = flags & SYS_RW;
+		if (nom_perm & SYS_READ)
+			nom_perm |= PTE_P | PTE_U;
+
+		checkva(tf, dva, size);
+		uint32_t a;
+		for (a = dva; a < dva + size; a += PAGESIZE) {
+			pte_t *pte = pmap_walk(cp->pdir, a, true);
+			assert(pte != NULL);
+			if (nom_perm)
+				*pte = *pte | nom_perm;
+			else
+				*pte = PGADDR(*pte);
+		}
+	}
+	if (flags & SYS_ADVICE)
+		do_advise(tf, cp, flags, dva, size);
+
+	// Note which mappings changed, in case a proc is away from home.
+	if (flags & (SYS_MEMOP | SYS_SHARE | SYS_PERM | SYS_ADVICE))
+		net_dirty(cp, dva, size);
+	if (flags & SYS_SHARE)
+		net_dirty(p, sva, size);
+}
+
+// Perform the memory operation and permission change in 'flags' for a GET,
+// on 'size' bytes from the child's 'sva' to local 'dva'.
+static void
+do_getmem(trapframe *tf, proc *p, proc *cp, uint32_t flags,
+		uint32_t sva, uint32_t dva, size_t size)
+{
+	// handle memory flags
+	uint32_t memop = flags & SYS_MEMOP;
+	if ((flags & SYS_MERGE) == SYS_MERGE) {
+		if (!cp->rpdir)		// nothing to merge against without SNAP
+			systrap(tf, T_GPFLT, 0);
+		pmap_merge(cp->rpdir, cp->pdir, sva, p->pdir, dva, size);
+	}
+	else if (memop & SYS_ZERO) {
+		checkva(tf, dva, size);
+		pmap_remove(p->pdir, dva, size);
+	}
+	else if (memop & SYS_COPY) {
+		checkva(tf, dva, size);
+		checkva(tf, sva, size);
+		pmap_copy(cp->pdir, sva, p->pdir, dva, size);
+	}
+	if (flags & SYS_SHARE)
+		do_share(tf, p, cp, sva, p, dva, size);
+	
+	// handle permission changes
+	//uint32_t perms = flags & SYS_PERM;
+	//flags ppdir localdest(dva) sz
+	if (flags & SYS_PERM) {
+		int nom_perm = flags & SYS_RW;
+		if (nom_perm & SYS_READ)
+			nom_perm |= PTE_P | PTE_U;
+
+		//pmap_setperm(p->pdir, dva, size, flags & SYS_RW);
+		checkva(tf, dva, size);
+		uint32_t a;
+		for (a = dva; a < dva + size; a += PAGESIZE) {
+			pte_t *pte = pmap_walk(p->pdir, a, true);
+			assert(pte != NULL);
+			if (nom_perm)
+				*pte = *pte | nom_perm;
+			else
+				*pte = PGADDR(*pte);
+		}
+	}
+	if (flags & SYS_ADVICE)
+		do_advise(tf, p, flags, dva, size);
+
+	// Note which mappings changed, in case a proc is away from home.
+	if (flags & (SYS_MEMOP | SYS_SHARE | SYS_PERM | SYS_ADVICE))
+		net_dirty(p, dva, size);
+	if (flags & SYS_SHARE)
+		net_dirty(cp, sva, size);
+}
+
+// With SYS_VEC, perform the memory operations in the array of 'n'
+// sysmemvec entries at user address 'vec', in order,
+// each validated just as a GET or PUT's single memory region would be.
+static void
+do_memvec(trapframe *tf, proc *p, proc *cp, bool put, uint32_t vec, uint32_t n)
+{
+	if (n > SYS_VECMAX)
+		systrap(tf, T_GPFLT, 0);
+	checkva(tf, vec, n * sizeof(sysmemvec));
+
+	int i;
+	for (i = 0; i < n; i++) {
+		sysmemvec v;
+		usercopy(tf, 0, &v, vec + i * sizeof(v), sizeof(v));
+		uint32_t flags = v.op & (SYS_MEMOP | SYS_SHARE | SYS_PERM | SYS_RW
+					| SYS_ADVICE);
+		if (put)
+			do_putmem(tf, p, cp, flags, (uint32_t) v.src,
+				(uint32_t) v.dst, v.size);
+		else
+			do_getmem(tf, p, cp, flags, (uint32_t) v.src,
+				(uint32_t) v.dst, v.size);
+	}
+}
+
+// Returns true if 'size' bytes at 'va' lie in user space, as checkva checks.
+static bool
+okva(uint32_t va, size_t size)
+{
+	return va >= VM_USERLO && va < VM_USERHI && size <= VM_USERHI - va;
+}
+
+// Pull in from other nodes whatever a GET or PUT with 'flags' on child 'cp'
+// is about to walk or read, for processes that migrated here and still
+// have page tables or pages elsewhere (see net_localize).
+// Waiting for a pull restarts the system call,
+// so we do this before changing anything.
+// Invalid regions are left for the operations themselves to reject.
+static void
+do_memready(trapframe *tf, proc *p, proc *cp, bool put, uint32_t flags,
+		uint32_t save, uint32_t sva, uint32_t dva, size_t size)
+{
+	if ((flags & SYS_REGS) && okva(save, sizeof(procstate)))
+		net_localize(tf, 0, p->pdir, save, sizeof(procstate), 1);
+	if (put && (flags & SYS_SNAP))
+		net_localize(tf, 0, cp->pdir, VM_USERLO,
+			VM_USERHI - VM_USERLO, 0);
+
+	if (flags & SYS_VEC) {
+		if (size > SYS_VECMAX || !okva(sva, size * sizeof(sysmemvec)))
+			return;
+		int i;
+		for (i = 0; i < size; i++) {
+			sysmemvec v;
+			usercopy(tf, 0, &v, sva + i * sizeof(v), sizeof(v));
+			do_memready(tf, p, cp, put, v.op & (SYS_MEMOP |
+				SYS_SHARE | SYS_PERM | SYS_ADVICE), 0,
+				(uint32_t) v.src, (uint32_t) v.dst, v.size);
+		}
+		return;
+	}
+
+	// Copies take remote pages along as they are, but need the page
+	// tables; anything that looks at or changes pages needs them local.
+	pde_t *spdir = put ? p->pdir : cp->pdir;
+	pde_t *dpdir = put ? cp->pdir : p->pdir;
+	uint32_t memop = flags & SYS_MEMOP;
+	bool merge = !put && memop == SYS_MERGE;
+	bool pages = merge || (flags & SYS_SHARE);
+	if (spdir && okva(sva, size) && ((memop & SYS_COPY) || pages))
+		net_localize(tf, 0, spdir, sva, size, pages);
+	if (merge && cp->rpdir && okva(sva, size))	// SNAP copied RRs too
+		net_localize(tf, 0, cp->rpdir, sva, size, 1);
+	if (dpdir && okva(dva, size) && (pages || memop == SYS_ZERO ||
+			(flags & (SYS_PERM | SYS_ADVICE))))
+		net_localize(tf, 0, dpdir, dva, size,
+			pages || (flags & SYS_PERM));
+}
+
+static void do_putchild(trapframe *tf, proc *p, proc *cp, uint32_t flags,
+		uint32_t save, uint32_t sva, uint32_t dva, size_t size);
+static void do_getchild(trapframe *tf, proc *p, proc *cp, uint32_t flags,
+		uint32_t save, uint32_t sva, uint32_t dva, size_t size);
+
 static void
 do_put(trapframe * tf, uint32_t flags){
 
@@ -131,7 +388,15 @@ do_put(trapframe * tf, uint32_t flags){
 	spinlock_acquire(&p->lock);
 	
 	if (!cp) {
+		if (flags & SYS_FREE) {		// nothing to tear down
+			spinlock_release(&p->lock);
+			trap_return(tf);
+		}
 		cp = proc_alloc(p, cp_i);
+		if (!cp) {			// out of memory, as sysnomem()
+			spinlock_release(&p->lock);
+			systrap(tf, T_PGFLT, 0);
+		}
 	}
 	
 	//We have to check this before doing anything
@@ -140,56 +405,108 @@ do_put(trapframe * tf, uint32_t flags){
 	}
 	
 	spinlock_release(&p->lock);
+
+	do_putchild(tf, p, cp, flags, tf->regs.ebx,
+			tf->regs.esi, tf->regs.edi, tf->regs.ecx);
+	trap_return(tf);
+}
+
+// Perform the operations of a PUT on stopped child 'cp' of 'p'.
+// 'save' is the user's procstate pointer, and the memory operations
+// apply to 'size' bytes from local 'sva' to the child's 'dva'.
+static void
+do_putchild(trapframe *tf, proc *p, proc *cp, uint32_t flags,
+		uint32_t save, uint32_t sva, uint32_t dva, size_t size)
+{
+	if (flags & SYS_FREE) {
+		proc_free(p, cp->childno);
+		return;
+	}
+	do_memready(tf, p, cp, 1, flags, save, sva, dva, size);
 	
 	if (flags & SYS_REGS){
-		usercopy(tf, 0, &cp->sv, tf->regs.ebx, sizeof(procstate));
+		// The FPU save area is only transferred with SYS_FPU.
+		// Flush any live FPU registers first, since the child keeps
+		// its old FPU state if the new pff still says PFF_USEFPU.
+		proc_fpusave(cp);
+		uint32_t weight = cp->sv.weight;
+		usercopy(tf, 0, &cp->sv, save, (flags & SYS_FPU) ?
+			sizeof(procstate) : offsetof(procstate, fx));
 		// memcpy(&cp->sv, cps, sizeof(procstate));
 		cp->sv.tf.eflags &= FL_USER;
+		cp->sv.tf.err = 0;		// return with IRET, not SYSEXIT
+		// Can't grant what we lack, except the root, which sees
+		// real I/O timing anyway and may opt its children in.
+		if (!(p->sv.pff & PFF_NONDET) && p != proc_root)
+			cp->sv.pff &= ~PFF_NONDET;
+		if (cp->sv.weight == 0)		// keep the current weight
+			cp->sv.weight = weight;
+		else if (cp->sv.weight > PROC_MAXWEIGHT)
+			cp->sv.weight = PROC_MAXWEIGHT;
+		cp->sv.fx.mxcsr &= 0xffff;	// reserved bits would #GP
+		cp->fpucpu = NULL;		// any cached FPU copy is stale
 	}
 
-	// handle memory flags
-	uintptr_t sva = tf->regs.esi;
-	uintptr_t dva = tf->regs.edi;
-	size_t size = tf->regs.ecx;
-	uint32_t memop = flags & SYS_MEMOP;
-
-	if (memop & SYS_ZERO) {
-		checkva(tf, dva, size);
-		pmap_remove(cp->pdir, dva, size);
-	} else if (memop & SYS_COPY) {
-		checkva(tf, sva, size);
-		checkva(tf, dva, size);
-		pmap_copy(p->pdir, sva, cp->pdir, dva, size);
-	}
-
-	// handle permission changes
-	//uint32_t perms = flags & SYS_PERM;
-	//flags cpdir childdest(dva) sz
-	if (flags & SYS_PERM) {
-		int nom_perm = flags & SYS_RW;
-		if (nom_perm & SYS_READ)
-			nom_perm |= PTE_P | PTE_U;
-
-		uint32_t a;
-		for (a = dva; a < dva + size; a += PAGESIZE) {
-			pte_t *pte = pmap_walk(cp->pdir, a, true);
-			assert(pte != NULL);
-			if (nom_perm)
-				*pte = *pte | nom_perm;
-			else
-				*pte = PGADDR(*pte);
-		}
-	}
+	if (flags & SYS_VEC)
+		do_memvec(tf, p, cp, 1, sva, size);
+	else
+		do_putmem(tf, p, cp, flags, sva, dva, size);
 
+	// Out of memory for the snapshot, report it as sysnomem() would;
+	// the child's own mappings don't change, so nothing becomes dirty.
+	// A half-synced snapshot would make a later merge copy wrong diffs,
+	// so drop it: a merge then fails until the next successful SNAP.
 	if (flags & SYS_SNAP) {
-		pmap_copy(cp->pdir, VM_USERLO, cp->rpdir, VM_USERLO, VM_USERHI - VM_USERLO);
+		if (!cp->rpdir)
+			cp->rpdir = pmap_newpdir();
+		if (!cp->rpdir)
+			systrap(tf, T_PGFLT, 0);
+		if (!pmap_sync(cp->pdir, VM_USERLO, cp->rpdir, VM_USERLO,
+				VM_USERHI - VM_USERLO)) {
+			mem_decref(mem_ptr2pi(cp->rpdir), pmap_freepdir);
+			cp->rpdir = NULL;
+			systrap(tf, T_PGFLT, 0);
+		}
 	}
 
 	if (flags & SYS_START){
+		proc_gangstart(p, cp);
 		proc_ready(cp);
 	}
+}
 
-	trap_return(tf);
+// Choose the child for a SYS_ANY get among children lo..hi of p
+// that are also in the bitmap 'set'; p must be locked.
+// With PFF_NONDET we take any child
+// that has stopped since we last got from it, or wait for one to do so.
+// Otherwise we deterministically take the lowest-numbered child
+// that is running or has stopped since we last got from it,
+// and the caller waits for it as usual.
+// Returns -1 if no child in the range has anything to report.
+static int
+do_getany(trapframe *tf, proc *p, int lo, int hi, const uint32_t *set)
+{
+	int i, first = -1;
+	bool running = 0;
+	for (i = lo; i <= hi; i++) {
+		proc *cp = p->child[i];
+		if (cp == NULL || !(set[i / 32] & (1 << (i % 32))))
+			continue;
+		if (cp->state == PROC_STOP && !cp->stopped)
+			continue;	// nothing new to report
+		if (cp->state == PROC_STOP && (p->sv.pff & PFF_NONDET))
+			return i;
+		if (cp->state != PROC_STOP)
+			running = 1;
+		if (first < 0)
+			first = i;
+	}
+	if (!(p->sv.pff & PFF_NONDET) || !running)
+		return first;
+
+	p->waitlo = lo;
+	p->waithi = hi;
+	proc_wait(p, NULL, tf);
 }
 
 static void
@@ -211,7 +528,22 @@ do_get(trapframe * tf, uint32_t flags){
 		}
 	}
 
+	// A SYS_ANY get may name the children it is interested in.
+	uint32_t set[PROC_CHILDREN/32];
+	if ((flags & SYS_ANY) && tf->regs.ebp != 0)
+		usercopy(tf, 0, set, tf->regs.ebp, sizeof(set));
+	else
+		memset(set, 0xff, sizeof(set));
+
 	spinlock_acquire(&p->lock);
+	if (flags & SYS_ANY) {
+		cp_i = do_getany(tf, p, cp_i, (tf->regs.edx >> 16) & 0xff, set);
+		if (cp_i < 0) {
+			spinlock_release(&p->lock);
+			tf->regs.edx = -1;
+			trap_return(tf);
+		}
+	}
 	proc *cp = p->child[cp_i];
 	
 	if (!cp) {
@@ -228,52 +560,293 @@ do_get(trapframe * tf, uint32_t flags){
 	
 	spinlock_release(&p->lock);
 
+	do_getchild(tf, p, cp, flags, tf->regs.ebx,
+			tf->regs.esi, tf->regs.edi, tf->regs.ecx);
+	if (flags & SYS_ANY)
+		tf->regs.edx = cp_i;	// tell the caller which child
+	trap_return(tf);
+}
+
+// Perform the operations of a GET on stopped child 'cp' of 'p'.
+// 'save' is the user's procstate pointer, and the memory operations
+// apply to 'size' bytes from the child's 'sva' to local 'dva'.
+static void
+do_getchild(trapframe *tf, proc *p, proc *cp, uint32_t flags,
+		uint32_t save, uint32_t sva, uint32_t dva, size_t size)
+{
+	do_memready(tf, p, cp, 0, flags, save, sva, dva, size);
+	cp->stopped = 0;
+
 	if (flags & SYS_REGS){
+		if (flags & SYS_FPU)
+			proc_fpusave(cp);
+		proc_getusage(cp);
 		// memcpy(ps, &cp->sv, sizeof(procstate));
-		usercopy(tf, 1, &cp->sv, tf->regs.ebx, sizeof(procstate));
+		usercopy(tf, 1, &cp->sv, save, (flags & SYS_FPU) ?
+			sizeof(procstate) : offsetof(procstate, fx));
 	}
 
-	// handle memory flags
-	uintptr_t sva = tf->regs.esi;
-	uintptr_t dva = tf->regs.edi;
-	size_t size = tf->regs.ecx;
-	uint32_t memop = flags & SYS_MEMOP;
-	if ((flags & SYS_MERGE) == SYS_MERGE) {
-		pmap_merge(cp->rpdir, cp->pdir, sva, p->pdir, dva, size);
+	if (flags & SYS_VEC)
+		do_memvec(tf, p, cp, 0, sva, size);
+	else
+		do_getmem(tf, p, cp, flags, sva, dva, size);
+}
+
+// Handle a GET or PUT with SYS_BATCH: EBX points to an array of ECX
+// sysbatch descriptors, each naming a local child and what to do with it.
+// We wait just once, until every child in the batch has stopped,
+// and then perform all the descriptors' operations in this kernel entry.
+static void
+do_batch(trapframe *tf, uint32_t cmd)
+{
+	proc *p = proc_cur();
+	uint32_t vec = tf->regs.ebx;
+	uint32_t n = tf->regs.ecx;
+	uint8_t nnum = (tf->regs.edx & 0xFF00) >> 8;
+	uint8_t cn[PROC_CHILDREN];
+	uint32_t seen[PROC_CHILDREN/32];
+	uint32_t freeing[PROC_CHILDREN/32];	// SYS_FREE entries
+	sysbatch b;
+	int i;
+
+	if (n > PROC_CHILDREN)
+		systrap(tf, T_GPFLT, 0);
+	checkva(tf, vec, n * sizeof(sysbatch));
+
+	// Batched children are always local: go home first if we're away.
+	if (nnum != net_node){
+		if (nnum != 0){
+			net_migrate(tf, nnum, 0);
+		}
+		else if (RRNODE(p->home) != net_node){
+			net_migrate(tf, RRNODE(p->home), 0);
+		}
 	}
-	else if (memop & SYS_ZERO) {
-		checkva(tf, dva, size);
-		pmap_remove(p->pdir, dva, size);
+
+	// Fetch the child numbers first, since usercopy can fault
+	// and we must not hold our lock while it does.
+	memset(seen, 0, sizeof(seen));
+	memset(freeing, 0, sizeof(freeing));
+	for (i = 0; i < n; i++) {
+		usercopy(tf, 0, &b, vec + i * sizeof(sysbatch), sizeof(b));
+		if (b.child >= PROC_CHILDREN || seen[b.child / 32] &
+				(1 << (b.child % 32)))
+			systrap(tf, T_GPFLT, 0);
+		seen[b.child / 32] |= 1 << (b.child % 32);
+		if (b.flags & SYS_FREE)
+			freeing[b.child / 32] |= 1 << (b.child % 32);
+		cn[i] = b.child;
 	}
-	else if (memop & SYS_COPY) {
-		checkva(tf, dva, size);
-		checkva(tf, sva, size);
-		pmap_copy(cp->pdir, sva, p->pdir, dva, size);
+
+	// Mark every child that is still running and wait for them all.
+	spinlock_acquire(&p->lock);
+	assert(p->waitn == 0);
+	for (i = 0; i < n; i++) {
+		proc *cp = p->child[cn[i]];
+		if (cp == NULL || cp->state == PROC_STOP)
+			continue;
+		cp->batchwait = 1;
+		p->waitn++;
 	}
-	
-	// handle permission changes
-	//uint32_t perms = flags & SYS_PERM;
-	//flags ppdir localdest(dva) sz
-	if (flags & SYS_PERM) {
-		int nom_perm = flags & SYS_RW;
-		if (nom_perm & SYS_READ)
-			nom_perm |= PTE_P | PTE_U;
+	if (p->waitn > 0)
+		proc_wait(p, NULL, tf);	// restart the batch when all stop
+	// Create the children we put to, except those we only free,
+	// so that running out of memory aborts the batch before any operation.
+	if ((cmd & SYS_TYPE) == SYS_PUT)
+		for (i = 0; i < n; i++)
+			if (!p->child[cn[i]] && !(freeing[cn[i] / 32] &
+					(1 << (cn[i] % 32))) &&
+					!proc_alloc(p, cn[i])) {
+				spinlock_release(&p->lock);
+				systrap(tf, T_PGFLT, 0); // as sysnomem()
+			}
+	spinlock_release(&p->lock);
 
-		//pmap_setperm(p->pdir, dva, size, flags & SYS_RW);
-		uint32_t a;
-		for (a = dva; a < dva + size; a += PAGESIZE) {
-			pte_t *pte = pmap_walk(p->pdir, a, true);
-			assert(pte != NULL);
-			if (nom_perm)
-				*pte = *pte | nom_perm;
-			else
-				*pte = PGADDR(*pte);
+	// Pull in any remote memory all the operations need up front,
+	// since waiting for it restarts the batch.
+	for (i = 0; i < n; i++) {
+		usercopy(tf, 0, &b, vec + i * sizeof(sysbatch), sizeof(b));
+		proc *cp = p->child[cn[i]];
+		if (b.child == cn[i] && !(b.flags & SYS_FREE))
+			do_memready(tf, p, cp ? cp : &proc_null,
+				(cmd & SYS_TYPE) == SYS_PUT, b.flags,
+				(uint32_t) b.save, (uint32_t) b.src,
+				(uint32_t) b.dst, b.size);
+	}
+
+	// Now every child in the batch is stopped: do the operations.
+	for (i = 0; i < n; i++) {
+		usercopy(tf, 0, &b, vec + i * sizeof(sysbatch), sizeof(b));
+		if (b.child != cn[i])		// changed under us: don't trust
+			systrap(tf, T_GPFLT, 0);
+		uint32_t flags = b.flags & ~(SYS_TYPE | SYS_ANY | SYS_BATCH);
+		proc *cp = p->child[cn[i]];
+		if ((cmd & SYS_TYPE) == SYS_PUT && !cp) {
+			if (!(flags & SYS_FREE))	// changed under us
+				systrap(tf, T_GPFLT, 0);
+			continue;		// nothing to tear down
 		}
+		if ((cmd & SYS_TYPE) == SYS_PUT)
+			do_putchild(tf, p, cp, flags, (uint32_t) b.save,
+				(uint32_t) b.src, (uint32_t) b.dst, b.size);
+		else
+			do_getchild(tf, p, cp ? cp : &proc_null, flags,
+				(uint32_t) b.save, (uint32_t) b.src,
+				(uint32_t) b.dst, b.size);
 	}
-	
 	trap_return(tf);
 }
 
+// Handle the RING system call: perform the gets and puts queued in
+// the sysring at EBX whose children are stopped, posting a completion
+// for each, and wait until ECX completions are available in the ring.
+// With PFF_NONDET we run each child's operations as soon as it stops;
+// otherwise we run all operations strictly in submission order.
+// The ring lives in the caller's memory, so we only touch it via usercopy;
+// whenever we wait, the whole system call restarts from the ring's state,
+// so that state must be up to date after every operation.
+static void
+do_ring(trapframe *tf, uint32_t cmd)
+{
+	proc *p = proc_cur();
+	uint32_t ring = tf->regs.ebx;
+	uint32_t want = tf->regs.ecx;
+	uint8_t nnum = (tf->regs.edx & 0xFF00) >> 8;
+	bool nondet = (p->sv.pff & PFF_NONDET) != 0;
+
+	if (ring & (PAGESIZE-1))
+		systrap(tf, T_GPFLT, 0);
+	checkva(tf, ring, sizeof(sysring));
+	net_localize(tf, 0, p->pdir, ring, sizeof(sysring), 1);
+	if (want > SYSRING_CQSIZE)
+		want = SYSRING_CQSIZE;
+
+	// Ring operations are always on local children, as for SYS_BATCH.
+	if (nnum != net_node){
+		if (nnum != 0){
+			net_migrate(tf, nnum, 0);
+		}
+		else if (RRNODE(p->home) != net_node){
+			net_migrate(tf, RRNODE(p->home), 0);
+		}
+	}
+
+	uint32_t idx[4];		// sqhead, sqtail, cqhead, cqtail
+	uint32_t busy[PROC_CHILDREN/32];
+	proc *block;
+	int i, lo, hi;
+again:
+	usercopy(tf, 0, idx, ring, sizeof(idx));
+	uint32_t head = idx[0], tail = idx[1], cqhead = idx[2], cqtail = idx[3];
+	if (tail - head > SYSRING_SQSIZE || cqtail - cqhead > SYSRING_CQSIZE)
+		systrap(tf, T_GPFLT, 0);
+
+	memset(busy, 0, sizeof(busy));
+	block = NULL;
+	lo = PROC_CHILDREN;
+	hi = -1;
+	for (i = head; i != tail; i++) {
+		if (cqtail - cqhead >= SYSRING_CQSIZE)
+			break;			// no room for the completion
+		uint32_t eva = ring + offsetof(sysring, sq) +
+				(i % SYSRING_SQSIZE) * sizeof(sysringsqe);
+		sysringsqe e;
+		usercopy(tf, 0, &e, eva, sizeof(e));
+		if (e.op == 0)
+			continue;		// done on an earlier pass
+
+		uint32_t type = e.op & SYS_TYPE;
+		int result = 0;
+		if (e.child >= PROC_CHILDREN ||
+				(type != SYS_GET && type != SYS_PUT))
+			result = -1;
+		else if (busy[e.child / 32] & (1 << (e.child % 32)))
+			continue;		// keep this child's ops in order
+		else {
+			spinlock_acquire(&p->lock);
+			proc *cp = p->child[e.child];
+			if (cp && cp->state != PROC_STOP) {
+				spinlock_release(&p->lock);
+				if (!nondet) {
+					block = cp;
+					break;
+				}
+				busy[e.child / 32] |= 1 << (e.child % 32);
+				if (e.child < lo) lo = e.child;
+				if (e.child > hi) hi = e.child;
+				continue;
+			}
+			uint32_t flags = e.op & ~(SYS_TYPE | SYS_ANY | SYS_BATCH);
+			if (!cp && type == SYS_PUT && !(flags & SYS_FREE)) {
+				cp = proc_alloc(p, e.child);
+				if (!cp) {		// out of memory, as sysnomem()
+					spinlock_release(&p->lock);
+					systrap(tf, T_PGFLT, 0);
+				}
+			}
+			spinlock_release(&p->lock);
+
+			if (!cp)	// no child to get from, or to free
+				result = type == SYS_PUT ? 0 : -1;
+			else if (type == SYS_PUT)
+				do_putchild(tf, p, cp, flags, (uint32_t) e.save,
+					(uint32_t) e.src, (uint32_t) e.dst, e.size);
+			else
+				do_getchild(tf, p, cp, flags, (uint32_t) e.save,
+					(uint32_t) e.src, (uint32_t) e.dst, e.size);
+		}
+
+		// Post the completion, mark the submission done,
+		// and retire the done submissions at the head of the queue.
+		// The ring is written back right away, since the next
+		// operation may restart the system call or abort it with a trap;
+		// these writes are all to the ring's one page, which we just
+		// wrote to, so none can restart or fault once the first is done.
+		sysringcqe c = { e.data, result };
+		usercopy(tf, 1, &c, ring + offsetof(sysring, cq) +
+			(cqtail % SYSRING_CQSIZE) * sizeof(c), sizeof(c));
+		cqtail++;
+		usercopy(tf, 1, &cqtail, ring + offsetof(sysring, cqtail),
+			sizeof(cqtail));
+		e.op = 0;
+		usercopy(tf, 1, &e.op, eva, sizeof(e.op));
+		for (; head != tail; head++) {
+			uint32_t op;
+			usercopy(tf, 0, &op, ring + offsetof(sysring, sq) +
+				(head % SYSRING_SQSIZE) * sizeof(sysringsqe) +
+				offsetof(sysringsqe, op), sizeof(op));
+			if (op != 0)
+				break;
+		}
+		usercopy(tf, 1, &head, ring + offsetof(sysring, sqhead),
+			sizeof(head));
+	}
+
+	if (cqtail - cqhead >= want || (block == NULL && hi < 0)) {
+		tf->regs.eax = cqtail - cqhead;
+		trap_return(tf);
+	}
+
+	// Wait for a child some operation is waiting for to stop,
+	// then run through the ring again.
+	spinlock_acquire(&p->lock);
+	if (block) {
+		if (block->state != PROC_STOP)
+			proc_wait(p, block, tf);
+		spinlock_release(&p->lock);
+		goto again;
+	}
+	for (i = lo; i <= hi; i++)
+		if ((busy[i / 32] & (1 << (i % 32))) &&
+				p->child[i]->state == PROC_STOP) {
+			spinlock_release(&p->lock);
+			goto again;	// stopped while we weren't looking
+		}
+	p->waitlo = lo;
+	p->waithi = hi;
+	proc_wait(p, NULL, tf);
+}
+
 static void
 do_ret(trapframe * tf, uint32_t flags){
 	proc *cur = proc_cur();
@@ -283,6 +856,23 @@ do_ret(trapframe * tf, uint32_t flags){
 	proc_ret(tf, 1);
 }
 
+// Register (or with a zero EBX, unregister) the caller's own
+// page fault upcall handler and alternate stack; see trap_upcall().
+static void
+do_upcall(trapframe *tf, uint32_t cmd)
+{
+	proc *p = proc_cur();
+	uint32_t eip = tf->regs.ebx;
+	uint32_t top = tf->regs.ecx;
+	uint32_t size = tf->regs.edx;
+	if (eip != 0)
+		checkva(tf, top - size, size);
+	p->sv.pfeip = eip;
+	p->sv.pfstack = top;
+	p->sv.pfsize = size;
+	trap_return(tf);
+}
+
 // Common function to handle all system calls -
 // decode the system call type and call an appropriate handler function.
 // Be sure to handle undefined system calls appropriately.
@@ -292,13 +882,35 @@ syscall(trapframe *tf)
 	// EAX register holds system call command/flags
 	uint32_t cmd = tf->regs.eax;
 	proc *p = proc_cur();
+	p->ru.nsyscall++;
+
+	// The SYSENTER stub leaves its return address at the top of its stack.
+	// If the user was single-stepping into it, keep doing so on return
+	// (trap_return then uses IRET rather than SYSEXIT).
+	if (tf->err == SYSENTER_ERR) {
+		cpu *c = cpu_cur();
+		if (c->sysstep) {
+			c->sysstep = 0;
+			tf->eflags |= FL_TF;
+		}
+		usercopy(tf, 0, &tf->eip, tf->esp, sizeof(tf->eip));
+	}
+
 	switch (cmd & SYS_TYPE) {
 	case SYS_CPUTS:	return do_cputs(tf, cmd);
 	// Your implementations of SYS_PUT, SYS_GET, SYS_RET here...
 
-	case SYS_PUT: return do_put(tf, cmd);
-	case SYS_GET: return do_get(tf, cmd);
+	case SYS_PUT:
+		if (cmd & SYS_BATCH)
+			return do_batch(tf, cmd);
+		return do_put(tf, cmd);
+	case SYS_GET:
+		if (cmd & SYS_BATCH)
+			return do_batch(tf, cmd);
+		return do_get(tf, cmd);
 	case SYS_RET: return do_ret(tf, cmd);
+	case SYS_RING: return do_ring(tf, cmd);
+	case SYS_UPCALL: return do_upcall(tf, cmd);
 	default: return;		// handle as a regular trap (is this what we're supposed to do? undefinied system calls?)
 	}
 }
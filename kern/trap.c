@@ -11,6 +11,8 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/vm.h>
 
 #include <kern/cpu.h>
 #include <kern/trap.h>
@@ -20,6 +22,7 @@
 #include <kern/syscall.h>
 #include <kern/pmap.h>
 #include <kern/net.h>
+#include <kern/kinfo.h>
 
 #include <dev/lapic.h>
 #include <dev/kbd.h>
@@ -208,6 +211,71 @@ trap_print(trapframe *tf)
 	cprintf("  ss   0x----%04x\n", tf->ss);
 }
 
+// Reflect a trap from user mode to the current process's parent,
+// migrating the process home first if it is away.
+static void gcc_noreturn
+trap_reflect(trapframe *tf)
+{
+	//cprintf("reflecting trap %d to parent\n", tf->trapno);
+	proc *cur = proc_cur();
+	if (RRNODE(cur->home) != net_node)
+		net_migrate(tf, RRNODE(cur->home), -1);
+	proc_ret(tf, -1);
+}
+
+// If pushing the upcall frame faults, give the original fault to the parent.
+static void gcc_noreturn
+trap_upcallrecover(trapframe *ktf, void *recoverdata)
+{
+	cpu_cur()->recover = NULL;
+	trap_reflect((trapframe *) recoverdata);
+}
+
+// Deliver a page fault from user mode to the process's own upcall handler
+// (see SYS_UPCALL in inc/syscall.h), if it has registered one:
+// push an upcallframe on its alternate stack and resume it at the handler.
+// Returns if there is no handler or the frame doesn't fit on its stack.
+static void
+trap_upcall(trapframe *tf)
+{
+	proc *p = proc_cur();
+	if (p->sv.pfeip == 0)
+		return;
+
+	// A fault in the handler itself nests below the faulting frame,
+	// leaving a word free for the handler to return through.
+	uint32_t lo = p->sv.pfstack - p->sv.pfsize;
+	uint32_t sp = p->sv.pfstack;
+	if (tf->esp > lo && tf->esp <= sp)
+		sp = tf->esp - 4;
+	if (sp < lo || sp - lo < sizeof(upcallframe))
+		return;
+	sp -= sizeof(upcallframe);
+	if (sp < VM_USERLO || sp > VM_USERHI - sizeof(upcallframe))
+		return;
+
+	uint32_t fva = rcr2();
+	net_localize(tf, -1, p->pdir, sp, sizeof(upcallframe), 1);
+
+	upcallframe uf;
+	uf.fva = fva;
+	uf.err = tf->err;
+	uf.regs = tf->regs;
+	uf.eip = tf->eip;
+	uf.eflags = tf->eflags;
+	uf.esp = tf->esp;
+
+	cpu *c = cpu_cur();
+	c->recover = trap_upcallrecover;
+	c->recoverdata = tf;
+	memmove((void *) sp, &uf, sizeof(uf));
+	c->recover = NULL;
+
+	tf->esp = sp;
+	tf->eip = p->sv.pfeip;
+	trap_return(tf);
+}
+
 void gcc_noreturn
 trap(trapframe *tf)
 {	
@@ -217,6 +285,10 @@ trap(trapframe *tf)
 	// and some versions of GCC rely on DF being clear.
 	asm volatile("cld" ::: "cc");
 
+	// Time up to here since we last left the kernel was user time.
+	if (tf->cs & 3)
+		proc_kenter();
+
 	/*
 	//Debug print trap info
 	if (tf->trapno != T_LTIMER){
@@ -230,6 +302,18 @@ trap(trapframe *tf)
 		else cprintf("kernel got trap %d\n", tf->trapno);
 	}*/
 	
+	// SYSENTER doesn't clear the trap flag, so a user single-stepping
+	// into it takes a debug trap on the first instruction of our entry
+	// point, in kernel mode.  Let the system call go ahead untraced,
+	// and have syscall() set the flag again for the return to user mode.
+	extern char sysenter_entry[];
+	if (tf->trapno == T_DEBUG && !(tf->cs & 3)
+			&& tf->eip == (uint32_t) sysenter_entry) {
+		tf->eflags &= ~FL_TF;
+		cpu_cur()->sysstep = 1;
+		trap_return(tf);
+	}
+
 	// check for page fault first
 	if (tf->trapno == T_PGFLT) {
 		pmap_pagefault(tf);
@@ -242,6 +326,7 @@ trap(trapframe *tf)
 		c->recover(tf, c->recoverdata);
 	}
 		
+
 	// Lab 2: your trap handling code here!
 	//cprintf("tf->trapno = %d\t%s\n", tf->trapno, trap_name(tf->trapno));
 	//cprintf("tf->err = %d\n", tf->err);
@@ -253,10 +338,24 @@ trap(trapframe *tf)
 	if (tf->trapno == T_SYSCALL) {
 		syscall(tf);
 	}
+	if (tf->trapno == T_DEVICE && (tf->cs & 3)) {
+		proc_fpuload(proc_cur());
+		trap_return(tf);
+	}
 	if (tf->trapno == T_LTIMER) {
 		lapic_eoi();
+		lapic_timerintr();
 		net_tick();
-		if (tf->cs & 3) proc_yield(tf);
+		kinfo_tick();
+		// A one-shot timer that expires with nobody else waiting
+		// just lets the current process keep running, tickless,
+		// until proc_ready() on another CPU kicks us.
+		// If the kick finds us in the kernel, tick until we can yield.
+		if (proc_head != NULL) {
+			if (tf->cs & 3)
+				proc_yield(tf);
+			lapic_periodic(lapic_quantum);
+		}
 		trap_return(tf);
 	}
 	if (tf->trapno == T_IRQ0+IRQ_SPURIOUS) {
@@ -273,14 +372,11 @@ trap(trapframe *tf)
 		trap_return(tf);
 	}
 	
-	if (tf->cs & 3) {
-		//cprintf("reflecting trap %d to parent\n", tf->trapno);
-		proc *cur = proc_cur();
-	    if(RRNODE(cur->home) != net_node) {
-	      net_migrate(tf, RRNODE(cur->home), -1);
-	    }
-		proc_ret(tf, -1);
-	}
+	if (tf->trapno == T_PGFLT && (tf->cs & 3))
+		trap_upcall(tf);	// returns if there's no handler for it
+
+	if (tf->cs & 3)
+		trap_reflect(tf);
 	
 	// If we panic while holding the console lock,
 	// release it so we don't get into a recursive panic that way.
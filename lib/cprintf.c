@@ -25,15 +25,23 @@
 #include <inc/assert.h>
 
 
-// Collect up to CPUTS_MAX-1 characters into a buffer
+// Collect up to CPRINTF_BUF characters into a buffer
 // and perform ONE system call to print all of them,
 // in order to make the lines output to the console atomic
 // and prevent interrupts from causing context switches
 // in the middle of a console output line and such.
+// Since cwrite() takes a length, the buffer is never NUL-terminated,
+// and user space can afford a larger buffer than the kernel's small stacks.
+#ifdef PIOS_KERNEL
+#define CPRINTF_BUF	CPUTS_MAX
+#else
+#define CPRINTF_BUF	1024
+#endif
+
 struct printbuf {
 	int idx;	// current buffer index
 	int cnt;	// total bytes printed so far
-	char buf[CPUTS_MAX];
+	char buf[CPRINTF_BUF];
 };
 
 
@@ -41,9 +49,8 @@ static void
 putch(int ch, struct printbuf *b)
 {
 	b->buf[b->idx++] = ch;
-	if (b->idx == CPUTS_MAX-1) {
-		b->buf[b->idx] = 0;
-		cputs(b->buf);
+	if (b->idx == CPRINTF_BUF) {
+		cwrite(b->buf, b->idx);
 		b->idx = 0;
 	}
 	b->cnt++;
@@ -58,8 +65,8 @@ vcprintf(const char *fmt, va_list ap)
 	b.cnt = 0;
 	vprintfmt((void*)putch, &b, fmt, ap);
 
-	b.buf[b.idx] = 0;
-	cputs(b.buf);
+	if (b.idx > 0)
+		cwrite(b.buf, b.idx);
 
 	return b.cnt;
 }
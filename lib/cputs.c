@@ -1,6 +1,7 @@
 /*
  * User-space implementation of cputs() for console output,
- * which just feeds the string to the sys_cputs() system call.
+ * which just feeds the string to the sys_cputs() system call,
+ * and of cwrite() for output of a known length via sys_cwrite().
  *
  * Copyright (C) 1997 Massachusetts Institute of Technology
  * See section "MIT License" in the file LICENSES for licensing terms.
@@ -16,3 +17,8 @@ void cputs(const char *str)
 	sys_cputs(str);
 }
 
+
+void cwrite(const char *buf, size_t len)
+{
+	sys_cwrite(buf, len);
+}
@@ -19,9 +19,16 @@
 #include <inc/vm.h>
 
 
+// While loading, the new program's stack is built in the top 4MB
+// of our scratch area, and its executable image below that.
+#define EXESTACK	(VM_SCRATCHHI-PTSIZE)
+
 // Maximum size of executable image we can load -
 // must fit in our scratch area for loading purposes.
-#define EXEMAX	MIN(VM_SHAREHI-VM_SHARELO,VM_SCRATCHHI-VM_SCRATCHLO)
+#define EXEMAX	MIN(VM_SHAREHI-VM_SHARELO,EXESTACK-VM_SCRATCHLO)
+
+// Maximum number of loadable segments in an executable.
+#define EXEMAXSEGS	16
 
 extern void start(void);
 extern void exec_start(intptr_t esp) gcc_noreturn;
@@ -50,9 +57,15 @@ execv(const char *path, char *const argv[])
 	// Setup child 0's stack with the argument array.
 	intptr_t esp = exec_copyargs(argv);
 
-	// Copy our Unix file system and process state into the child.
-	sys_put(SYS_COPY, 0, NULL, (void*)VM_FILELO, (void*)VM_FILELO,
-		VM_FILEHI-VM_FILELO);
+	// Copy the ELF image and the stack into their correct positions
+	// in child 0, along with our Unix file system and process state.
+	sysmemvec v[3] = {
+		{ SYS_COPY, (void*)VM_SCRATCHLO, (void*)VM_USERLO, EXEMAX },
+		{ SYS_COPY, (void*)EXESTACK, (void*)VM_STACKHI-PTSIZE, PTSIZE },
+		{ SYS_COPY, (void*)VM_FILELO, (void*)VM_FILELO,
+			VM_FILEHI-VM_FILELO },
+	};
+	sys_put(SYS_VEC, 0, NULL, v, NULL, 3);
 
 	// Copy child 0's entire memory state onto ours
 	// and start the new program.  See lib/entry.S for details.
@@ -62,8 +75,15 @@ execv(const char *path, char *const argv[])
 int
 exec_readelf(const char *path)
 {
-	// We'll load the ELF image into a scratch area in our address space.
-	sys_get(SYS_ZERO, 0, NULL, NULL, (void*)VM_SCRATCHLO, EXEMAX);
+	// We'll load the ELF image into a scratch area in our address space,
+	// first zeroing it and then mapping the pages each segment touches,
+	// with one system call for the whole vector of memory operations.
+	// The pages we'll copy file contents into get populated right away.
+	// Read-only segments lose their write permission in a second vector.
+	sysmemvec map[1+2*EXEMAXSEGS], ro[EXEMAXSEGS];
+	int nmap = 0, nro = 0;
+	map[nmap++] = (sysmemvec) { SYS_ZERO, NULL,
+				(void*)VM_SCRATCHLO, EXEMAX };
 
 	// Open the ELF image to load.
 	filedesc *fd = filedesc_open(NULL, path, O_RDONLY, 0);
@@ -86,9 +106,14 @@ exec_readelf(const char *path)
 		warn("exec_readelf: ELF program header truncated");
 		goto err;
 	}
+	proghdr *ph0 = ph;
 	for (; ph < eph; ph++) {
 		if (ph->p_type != ELF_PROG_LOAD)
 			continue;
+		if (nmap > 2*EXEMAXSEGS - 1) {
+			warn("exec_readelf: too many loadable segments");
+			goto err;
+		}
 
 		// The executable should fit in the first 4MB of user space.
 		intptr_t valo = ph->p_va;
@@ -100,17 +125,7 @@ exec_readelf(const char *path)
 			goto err;
 		}
 
-		// Map all pages the segment touches in our scratch region.
-		// They've already been zeroed by the SYS_ZERO above.
-		intptr_t scratchofs = VM_SCRATCHLO - VM_USERLO;
-		intptr_t pagelo = ROUNDDOWN(valo, PAGESIZE);
-		intptr_t pagehi = ROUNDUP(vahi, PAGESIZE);
-		sys_get(SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL,
-			(void*)pagelo + scratchofs, pagehi - pagelo);
-
-		// Initialize the file-loaded part of the ELF image.
-		// (We could use copy-on-write if SYS_COPY
-		// supports copying at arbitrary page boundaries.)
+		// The file-loaded part of the segment must be in the file.
 		intptr_t filelo = ph->p_offset;
 		intptr_t filehi = filelo + ph->p_filesz;
 		if (filelo < 0 || filelo > imgsize
@@ -118,18 +133,39 @@ exec_readelf(const char *path)
 			warn("exec_readelf: loaded section out of bounds");
 			goto err;
 		}
-		memcpy((void*)valo + scratchofs, imgdata + filelo,
-			filehi - filelo);
 
-		// Finally, remove write permissions on read-only segments.
+		// Map all pages the segment touches in our scratch region,
+		// after they have been zeroed by the SYS_ZERO above,
+		// populating those the file-loaded part will be copied into.
+		// The rest (bss) stays zero-mapped until the program uses it.
+		intptr_t scratchofs = VM_SCRATCHLO - VM_USERLO;
+		intptr_t pagelo = ROUNDDOWN(valo, PAGESIZE);
+		intptr_t pagehi = ROUNDUP(vahi, PAGESIZE);
+		intptr_t pagemid = MIN(ROUNDUP(valo + ph->p_filesz, PAGESIZE),
+					pagehi);
+		map[nmap++] = (sysmemvec) { SYS_PERM | SYS_RW | SYS_WILLNEED,
+			NULL, (void*)pagelo + scratchofs, pagemid - pagelo };
+		map[nmap++] = (sysmemvec) { SYS_PERM | SYS_RW,
+			NULL, (void*)pagemid + scratchofs, pagehi - pagemid };
 		if (!(ph->p_flags & ELF_PROG_FLAG_WRITE))
-			sys_get(SYS_PERM | SYS_READ, 0, NULL, NULL,
-				(void*)pagelo + scratchofs, pagehi - pagelo);
+			ro[nro++] = (sysmemvec) { SYS_PERM | SYS_READ,
+				NULL, (void*)pagelo + scratchofs,
+				pagehi - pagelo };
 	}
+	sys_get(SYS_VEC, 0, NULL, map, NULL, nmap);
+
+	// Initialize the file-loaded part of each segment.
+	// (We could use copy-on-write if SYS_COPY
+	// supports copying at arbitrary page boundaries.)
+	for (ph = ph0; ph < eph; ph++)
+		if (ph->p_type == ELF_PROG_LOAD)
+			memcpy((void*)ph->p_va + VM_SCRATCHLO - VM_USERLO,
+				imgdata + ph->p_offset, ph->p_filesz);
 
-	// Copy the ELF image into its correct position in child 0.
-	sys_put(SYS_COPY, 0, NULL, (void*)VM_SCRATCHLO,
-		(void*)VM_USERLO, EXEMAX);
+	// Finally, remove write permissions on read-only segments.
+	// execv() copies the image into child 0.
+	if (nro > 0)
+		sys_get(SYS_VEC, 0, NULL, ro, NULL, nro);
 
 	// The new program should have the same entrypoint as we do!
 	if (eh->e_entry != (intptr_t)start) {
@@ -148,20 +184,30 @@ err:
 intptr_t
 exec_copyargs(char *const argv[])
 {
-	// Give the process a nice big 4MB, zero-filled stack.
-	sys_get(SYS_ZERO | SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL,
-		NULL, (void*)VM_SCRATCHLO, PTSIZE);
+	// Give the process a nice big 4MB, zero-filled stack,
+	// populating just the pages at the top the arguments will fill.
+	size_t argsize = 3 * sizeof(intptr_t);	// argc, argv, argv[argc]
+	int n;
+	for (n = 0; argv[n]; n++)
+		argsize += strlen(argv[n]) + 1 + sizeof(char *);
+	argsize = MIN(ROUNDUP(argsize, PAGESIZE), PTSIZE);
+	sysmemvec v[2] = {
+		{ SYS_ZERO | SYS_PERM | SYS_RW, NULL, (void*)EXESTACK, PTSIZE },
+		{ SYS_WILLNEED, NULL, (void*)EXESTACK + PTSIZE - argsize,
+			argsize },
+	};
+	sys_get(SYS_VEC, 0, NULL, v, NULL, 2);
 	
 	// Lab 4: insert your code here to copy our command-line arguments
 	// onto the new process's stack, taking into account the fact that
-	// the stack area is mapped at VM_SCRATCHLO to VM_SCRATCHLO+PTSIZE
+	// the stack area is mapped at EXESTACK to EXESTACK+PTSIZE
 	// in _our_ address space while we're copying the arguments,
 	// but the pointers we're writing into this space will be
 	// interpreted by the newly executed process,
 	// where the stack will be mapped from VM_STACKHI-PTSIZE to VM_STACKHI.
 	
 	intptr_t esp = VM_STACKHI;      // no arguments - fix this.
-	intptr_t new_esp = VM_SCRATCHLO + PTSIZE;
+	intptr_t new_esp = EXESTACK + PTSIZE;
 	int diff = esp - new_esp;
 	
 	int argc = 0;
@@ -187,10 +233,7 @@ exec_copyargs(char *const argv[])
 	new_esp -= sizeof(int);
 	*(intptr_t *) new_esp = argc;
 	
-	// Copy the stack into its correct position in child 0.
-	sys_put(SYS_COPY, 0, NULL, (void*)VM_SCRATCHLO,
-		(void*)VM_STACKHI-PTSIZE, PTSIZE);
-
+	// execv() copies the stack into its correct position in child 0.
 	//cprintf("exec_copyargs() complete\n");
 	return new_esp + diff;
 }
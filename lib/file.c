@@ -135,9 +135,18 @@ fileino_write(int ino, off_t ofs, const void *buf, size_t eltsize, size_t count)
 		return -1;
 	}
 
-	if (fi->size == 0)
-		sys_get(SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL, FILEDATA(ino),
-				PTSIZE);
+	// Make sure every page the write touches is writable.
+	// When the write grows the file into new pages or spans several,
+	// have the kernel fill in those pages in one pass
+	// instead of taking a copy-on-write fault on each one.
+	// A write past the end of the file also covers the hole it leaves,
+	// so that the hole reads back as zeros.
+	size_t pagelo = MIN(ROUNDDOWN(ofs, PAGESIZE),
+				ROUNDUP(fi->size, PAGESIZE));
+	size_t pagehi = ROUNDUP(ofs + sz, PAGESIZE);
+	if (pagehi > ROUNDUP(fi->size, PAGESIZE) || pagehi - pagelo > PAGESIZE)
+		sys_get(SYS_PERM | SYS_RW | SYS_WILLNEED, 0, NULL, NULL,
+			FILEDATA(ino) + pagelo, pagehi - pagelo);
 
 	memmove(FILEDATA(ino) + ofs, buf, sz);
 	fi->size = MAX(fi->size, sz + ofs);
@@ -178,16 +187,18 @@ fileino_truncate(int ino, off_t newsize)
 	size_t oldpagelim = ROUNDUP(files->fi[ino].size, PAGESIZE);
 	size_t newpagelim = ROUNDUP(newsize, PAGESIZE);
 	if (newsize > oldsize) {
-		// Grow the file and fill the new space with zeros.
+		// Grow the file, mapping any new pages as zero-filled memory.
+		// Pages past the old end are already zero since we shrank them
+		// with SYS_DONTNEED, so only the old last page needs clearing.
 		sys_get(SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL,
 			FILEDATA(ino) + oldpagelim,
 			newpagelim - oldpagelim);
-		memset(FILEDATA(ino) + oldsize, 0, newsize - oldsize);
+		memset(FILEDATA(ino) + oldsize, 0,
+			MIN((size_t) newsize, oldpagelim) - oldsize);
 	} else if (newsize > 0) {
-		// Shrink the file, but not all the way to empty.
-		// Would prefer to use SYS_ZERO to free the file content,
-		// but SYS_ZERO isn't guaranteed to work at page granularity.
-		sys_get(SYS_PERM, 0, NULL, NULL,
+		// Shrink the file, but not all the way to empty:
+		// drop the contents of whole pages past the new end.
+		sys_get(SYS_PERM | SYS_DONTNEED, 0, NULL, NULL,
 			FILEDATA(ino) + newpagelim, FILE_MAXSIZE - newpagelim);
 	} else {
 		// Shrink the file to empty.  Use SYS_ZERO to free completely.
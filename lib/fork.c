@@ -25,6 +25,13 @@
 bool reconcile(pid_t pid, filestate *cfiles);
 bool reconcile_inode(pid_t pid, filestate *cfiles, int pino, int cino);
 bool reconcile_merge(pid_t pid, filestate *cfiles, int pino, int cino);
+void reconcile_flush(pid_t pid);
+static void reconcile_copy(pid_t pid, void *src, void *dst);
+
+// File copies from the child that reconcile_inode() queues up,
+// to be done with a single SYS_VEC get by reconcile_flush().
+static sysmemvec reconcile_vec[SYS_VECMAX];
+static int reconcile_nvec;
 
 pid_t fork(void)
 {
@@ -108,15 +115,22 @@ waitpid(pid_t pid, int *status, int options)
 	assert(pid >= -1 && pid < 256);
 
 	// Find a process to wait for.
-	// Of course for interactive or load-balancing purposes
-	// we would like to have a way to wait for
-	// whichever child process happens to finish first -
-	// that requires a (nondeterministic) kernel API extension.
-	if (pid <= 0)
-		for (pid = 1; pid < 256; pid++)
-			if (files->child[pid].state == PROC_FORKED)
-				break;
-	if (pid == 256 || files->child[pid].state != PROC_FORKED) {
+	// To wait for any child, we let the kernel pick whichever stops first
+	// (or, if we aren't allowed nondeterminism, the lowest-numbered one)
+	// among our forked children, leaving alone any other children
+	// such as threads, whose stops aren't ours to collect.
+	bool any = (pid <= 0);
+	uint32_t forked[PROC_CHILDREN/32];
+	if (any) {
+		memset(forked, 0, sizeof(forked));
+		pid_t i;
+		for (i = 255; i >= 1; i--)
+			if (files->child[i].state == PROC_FORKED) {
+				forked[i/32] |= 1 << (i%32);
+				pid = i;
+			}
+	}
+	if (pid <= 0 || files->child[pid].state != PROC_FORKED) {
 		errno = ECHILD;
 		return -1;
 	}
@@ -126,8 +140,18 @@ waitpid(pid_t pid, int *status, int options)
 		// Wait for the child to finish whatever it's doing,
 		// and extract its CPU and process/file state.
 		struct procstate ps;
-		sys_get(SYS_COPY | SYS_REGS, pid, &ps,
-			(void*)FILESVA, (void*)VM_SCRATCHLO, PTSIZE);
+		if (any) {
+			pid = sys_getany(SYS_COPY | SYS_REGS, 1, 255, forked,
+				&ps, (void*)FILESVA, (void*)VM_SCRATCHLO,
+				PTSIZE);
+			if (pid < 0 || files->child[pid].state != PROC_FORKED) {
+				errno = ECHILD;
+				return -1;
+			}
+			any = 0;
+		} else
+			sys_get(SYS_COPY | SYS_REGS, pid, &ps,
+				(void*)FILESVA, (void*)VM_SCRATCHLO, PTSIZE);
 		filestate *cfiles = (filestate*)VM_SCRATCHLO;
 
 		// Did the child take a trap?
@@ -140,8 +164,8 @@ waitpid(pid_t pid, int *status, int options)
 				*status = WSIGNALED | ps.tf.trapno;
 
 			done:
-			// Clear out the child's address space.
-			sys_put(SYS_ZERO, pid, NULL, ALLVA, ALLVA, ALLSIZE);
+			// Tear down the child and its address space.
+			sys_put(SYS_FREE, pid, NULL, NULL, NULL, 0);
 			files->child[pid].state = PROC_FREE;
 			return pid;
 		}
@@ -261,10 +285,31 @@ reconcile(pid_t pid, filestate *cfiles)
 
 		didio |= reconcile_inode(pid, cfiles, pino, cino);
 	}
+	reconcile_flush(pid);
 
 	return didio;
 }
 
+// Queue a file-sized copy from child 'pid' for reconcile_flush().
+static void
+reconcile_copy(pid_t pid, void *src, void *dst)
+{
+	if (reconcile_nvec == SYS_VECMAX)
+		reconcile_flush(pid);
+	reconcile_vec[reconcile_nvec++] =
+		(sysmemvec) { SYS_COPY, src, dst, PTSIZE };
+}
+
+// Perform all the file copies reconcile_copy() has queued.
+void
+reconcile_flush(pid_t pid)
+{
+	if (reconcile_nvec > 0)
+		sys_get(SYS_VEC, pid, NULL, reconcile_vec, NULL,
+			reconcile_nvec);
+	reconcile_nvec = 0;
+}
+
 bool
 reconcile_inode(pid_t pid, filestate *cfiles, int pino, int cino)
 {
@@ -327,7 +372,7 @@ reconcile_inode(pid_t pid, filestate *cfiles, int pino, int cino)
 		cfi->rlen = cfi->size;
 		
 		//Copy file
-		sys_get(SYS_COPY, pid, NULL, FILEDATA(cino), FILEDATA(pino), PTSIZE);
+		reconcile_copy(pid, FILEDATA(cino), FILEDATA(pino));
 		
 		return 1;
 	}
@@ -345,7 +390,7 @@ reconcile_inode(pid_t pid, filestate *cfiles, int pino, int cino)
 		cfi->rlen = cfi->size;
 		
 		//Copy file
-		sys_get(SYS_COPY, pid, NULL, FILEDATA(pino), FILEDATA(cino), PTSIZE);
+		reconcile_copy(pid, FILEDATA(pino), FILEDATA(cino));
 		
 		return 1;
 	}
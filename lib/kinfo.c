@@ -0,0 +1,68 @@
+/*
+ * User-space readers for the kernel information page (see inc/kinfo.h).
+ */
+
+#include <inc/kinfo.h>
+#include <inc/x86.h>
+
+#define barrier()	asm volatile("" : : : "memory")
+
+int
+kinfo_node(void)
+{
+	return KINFO->node;
+}
+
+int
+kinfo_ncpu(void)
+{
+	return KINFO->ncpu;
+}
+
+uint32_t
+kinfo_tscpu(void)
+{
+	return KINFO->tscpu;
+}
+
+uint64_t
+kinfo_ticks(void)
+{
+	uint32_t seq;
+	uint64_t ticks;
+	do {
+		seq = KINFO->seq;
+		barrier();
+		ticks = KINFO->ticks;
+		barrier();
+	} while ((seq & 1) || seq != KINFO->seq);
+	return ticks;
+}
+
+// Extrapolate from the kernel's last update with the TSC,
+// so the time keeps advancing even while the timer is stopped.
+uint64_t
+kinfo_time(void)
+{
+	uint32_t seq, tscpu;
+	uint64_t tsc, time;
+	do {
+		seq = KINFO->seq;
+		barrier();
+		tsc = KINFO->tsc;
+		time = KINFO->time;
+		tscpu = KINFO->tscpu;
+		barrier();
+	} while ((seq & 1) || seq != KINFO->seq);
+
+	uint64_t now = rdtsc();
+	return now > tsc ? time + (now - tsc) / tscpu : time;
+}
+
+uint32_t
+kinfo_load(int node)
+{
+	if (node < 0 || node > KINFO_MAXNODES)
+		return 0;
+	return KINFO->load[node];
+}
@@ -0,0 +1,31 @@
+/*
+ * User-level page fault handling through kernel upcalls.
+ */
+
+#include <inc/syscall.h>
+#include <inc/mmu.h>
+
+// Size of the alternate stack page fault handlers run on
+#define PGFAULT_STACKSIZE	(2*PAGESIZE)
+
+static uint8_t gcc_aligned(16) pgfault_stack[PGFAULT_STACKSIZE];
+
+// Called from _pgfault_upcall in lib/pfentry.S
+void (*_pgfault_handler)(upcallframe *uf);
+
+extern void _pgfault_upcall(void);
+
+// Have page faults this process's parent would otherwise see
+// delivered to 'handler' instead, or to the parent again if NULL.
+// Once the handler returns, the faulting instruction is retried
+// with the registers in the upcallframe, which it may modify.
+void
+set_pgfault_handler(void (*handler)(upcallframe *uf))
+{
+	_pgfault_handler = handler;
+	if (handler != NULL)
+		sys_upcall(_pgfault_upcall, pgfault_stack + PGFAULT_STACKSIZE,
+			PGFAULT_STACKSIZE);
+	else
+		sys_upcall(NULL, NULL, 0);
+}
@@ -0,0 +1,56 @@
+/*
+ * Lock-free single-producer, single-consumer queue (see inc/spsc.h).
+ * x86 never reorders stores with other stores or loads with other loads,
+ * so only the compiler has to be kept from moving slot accesses
+ * across the updates of head and tail.
+ */
+
+#include <inc/spsc.h>
+#include <inc/string.h>
+
+#define barrier()	asm volatile("" : : : "memory")
+
+int
+spsc_init(spsc *q, size_t size, size_t slotsize)
+{
+	if (slotsize == 0 || size < sizeof(spsc) + slotsize)
+		return -1;
+
+	// Round the slot count down to a power of two
+	uint32_t n = (size - sizeof(spsc)) / slotsize;
+	while (n & (n - 1))
+		n &= n - 1;
+
+	q->head = q->tail = 0;
+	q->nslots = n;
+	q->slotsize = slotsize;
+	return n;
+}
+
+int
+spsc_push(spsc *q, const void *data)
+{
+	uint32_t tail = q->tail;
+	if (tail - q->head == q->nslots)
+		return -1;		// full
+	barrier();
+	memcpy(&q->slots[(tail & (q->nslots - 1)) * q->slotsize], data,
+		q->slotsize);
+	barrier();
+	q->tail = tail + 1;		// publish the slot
+	return 0;
+}
+
+int
+spsc_pop(spsc *q, void *data)
+{
+	uint32_t head = q->head;
+	if (q->tail == head)
+		return -1;		// empty
+	barrier();
+	memcpy(data, &q->slots[(head & (q->nslots - 1)) * q->slotsize],
+		q->slotsize);
+	barrier();
+	q->head = head + 1;		// hand the slot back
+	return 0;
+}
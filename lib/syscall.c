@@ -0,0 +1,16 @@
+/*
+ * User-space support for the system call stubs in inc/syscall.h.
+ */
+
+#include <inc/syscall.h>
+#include <inc/x86.h>
+
+int sys_sysenter = -1;
+
+// Decide whether to make system calls with SYSENTER.
+// The kernel enables it in cpu_init() under exactly the same test.
+int
+sys_sysenter_init(void)
+{
+	return sys_sysenter = hassysenter();
+}
@@ -65,8 +65,10 @@ tfork(uint16_t child)
 	}
 
 	// Fork the child, copying our entire user address space into it.
+	// If the child is left over from an earlier tfork and tjoin,
+	// SYS_SYNC just updates the pages that changed since then.
 	ps.tf.regs.eax = 0;	// isparent == 0 in the child
-	sys_put(SYS_REGS | SYS_COPY | SYS_SNAP | SYS_START, child,
+	sys_put(SYS_REGS | SYS_SYNC | SYS_SNAP | SYS_START, child,
  		&ps, ALLVA, ALLVA, ALLSIZE);
 
 	return 1;
@@ -88,5 +90,15 @@ tjoin(uint16_t child)
 		panic("tjoin: unexpected trap %d, expecting %d\n",
 			ps.tf.trapno, T_SYSCALL);
 	}
+
+	// The thread's results are merged.  Keep the stopped child around
+	// so the next tfork into it can update it instead of copying afresh.
+}
+
+// Release a joined thread's child process and its snapshot.
+void
+tfree(uint16_t child)
+{
+	sys_put(SYS_FREE, child, NULL, NULL, NULL, 0);
 }
 
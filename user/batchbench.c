@@ -0,0 +1,135 @@
+/*
+ * Benchmark comparing batched GET/PUT (SYS_BATCH) and the submission ring
+ * (SYS_RING) against the usual loop of one sys_put and one sys_get per child,
+ * for a set of children that each just return to us when started.
+ *
+ * Usage: batchbench [iterations]
+ */
+
+#include <inc/stdio.h>
+#include <inc/stdlib.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/syscall.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/vm.h>
+
+#define NCHILD		4		// As many as psearch uses
+#define FIRSTCHILD	1		// First child number to use
+
+#define ALLVA		((void*) VM_USERLO)
+#define ALLSIZE		(VM_USERHI - VM_USERLO)
+
+uint8_t gcc_aligned(16) stack[NCHILD][PAGESIZE];
+
+// Each child just returns to its parent every time it is started.
+void
+spin(void)
+{
+	while (1)
+		sys_ret();
+}
+
+// Start and collect all children once per iteration, one child at a time.
+uint64_t
+loop(int iters)
+{
+	uint64_t start = rdtsc();
+	int i, n;
+	for (n = 0; n < iters; n++) {
+		for (i = 0; i < NCHILD; i++)
+			sys_put(SYS_START, FIRSTCHILD + i, NULL, NULL, NULL, 0);
+		for (i = 0; i < NCHILD; i++)
+			sys_get(0, FIRSTCHILD + i, NULL, NULL, NULL, 0);
+	}
+	return rdtsc() - start;
+}
+
+// Start and collect all children once per iteration, with one batch each.
+uint64_t
+batch(int iters)
+{
+	sysbatch put[NCHILD], get[NCHILD];
+	int i, n;
+	memset(put, 0, sizeof(put));
+	memset(get, 0, sizeof(get));
+	for (i = 0; i < NCHILD; i++) {
+		put[i].flags = SYS_START;
+		put[i].child = get[i].child = FIRSTCHILD + i;
+	}
+
+	uint64_t start = rdtsc();
+	for (n = 0; n < iters; n++) {
+		sys_batch(SYS_PUT, put, NCHILD);
+		sys_batch(SYS_GET, get, NCHILD);
+	}
+	return rdtsc() - start;
+}
+
+sysring gcc_aligned(PAGESIZE) ring;
+
+// Start and collect all children once per iteration through the ring,
+// with one system call per iteration.
+uint64_t
+ringed(int iters)
+{
+	sysringcqe c;
+	int i, n;
+
+	uint64_t start = rdtsc();
+	for (n = 0; n < iters; n++) {
+		for (i = 0; i < NCHILD; i++)
+			sys_ringput(&ring, SYS_PUT | SYS_START, FIRSTCHILD + i,
+				NULL, NULL, NULL, 0, i);
+		for (i = 0; i < NCHILD; i++)
+			sys_ringput(&ring, SYS_GET, FIRSTCHILD + i,
+				NULL, NULL, NULL, 0, i);
+		sys_ring(&ring, 2 * NCHILD);
+		while (sys_ringget(&ring, &c) == 0)
+			assert(c.result == 0);
+	}
+	return rdtsc() - start;
+}
+
+int
+main(int argc, char **argv)
+{
+	int iters = argc > 1 ? strtol(argv[1], NULL, 0) : 1000;
+	if (iters <= 0) {
+		fprintf(stderr, "Usage: batchbench [iterations]\n");
+		exit(1);
+	}
+
+	// Create the children, each with its own stack to return from.
+	procstate ps;
+	int i;
+	memset(&ps, 0, sizeof(ps));
+	for (i = 0; i < NCHILD; i++) {
+		ps.tf.eip = (uint32_t) spin;
+		ps.tf.esp = (uint32_t) &stack[i][PAGESIZE];
+		sys_put(SYS_REGS | SYS_COPY, FIRSTCHILD + i, &ps,
+			ALLVA, ALLVA, ALLSIZE);
+	}
+
+	// Warm up both paths, checking the batched one does what it should.
+	loop(1);
+	ringed(1);
+	batch(1);
+	for (i = 0; i < NCHILD; i++) {
+		sys_get(SYS_REGS, FIRSTCHILD + i, &ps, NULL, NULL, 0);
+		assert(ps.tf.trapno == T_SYSCALL);
+	}
+
+	uint64_t tl = loop(iters);
+	uint64_t tb = batch(iters);
+	uint64_t tr = ringed(iters);
+	printf("batchbench: %d children, %d iterations\n", NCHILD, iters);
+	printf("  per-child loop: %llu cycles/iteration\n", tl / iters);
+	printf("  batched:        %llu cycles/iteration\n", tb / iters);
+	printf("  ring:           %llu cycles/iteration\n", tr / iters);
+
+	for (i = 0; i < NCHILD; i++)
+		sys_put(SYS_FREE, FIRSTCHILD + i, NULL, NULL, NULL, 0);
+	return 0;
+}
@@ -15,6 +15,7 @@
 #include <inc/unistd.h>
 #include <inc/assert.h>
 #include <inc/syscall.h>
+#include <inc/kinfo.h>
 
 #include "md5.c"	// Bad practice, but hey, it's easy...
 
@@ -83,14 +84,19 @@ int psearch(uint8_t *str, int len, const unsigned char *hash)
 	if (len <= BLOCKLEN)
 		return search(str, len, 0, len, hash);
 
+	// Child numbers to use when forking off workers:
+	// node number in bits 15-8, intra-node child number in 7-0.
+	// Two run on our own node and two on the other of nodes 1-2.
+	// The same workers are reused for every block, each re-fork
+	// only updating the pages that changed, and freed at the end.
+	int me = kinfo_node() ? kinfo_node() : 1;
+	int other = me == 1 ? 2 : 1;
+	int child[4] = { me << 8 | 1, me << 8 | 2,
+			other << 8 | 3, other << 8 | 4 };
+	int i, done = 0;
+
 	// Iterate over blocks, searching 4 blocks at a time in parallel
-	int done = 0;
 	do {
-		// Child numbers to use when forking off workers:
-		// node number in bits 15-8, intra-node child number in 7-0.
-		static int child[4] = {0x0101,0x0102,0x0203,0x0204};
-
-		int i;
 		for (i = 0; i < sizeof(child)/sizeof(child[0]); i++) {
 			if (!tfork(child[i])) {
 				cprintf("child %x: search from '%s'\n",
@@ -102,10 +108,11 @@ int psearch(uint8_t *str, int len, const unsigned char *hash)
 		}
 		for (i = 0; i < sizeof(child)/sizeof(child[0]); i++)
 			tjoin(child[i]);	// collect results
-		if (found)
-			return 1;
-	} while (!done);
-	return 0;	// no match at this string length
+	} while (!found && !done);
+
+	for (i = 0; i < sizeof(child)/sizeof(child[0]); i++)
+		tfree(child[i]);
+	return found;	// zero if no match at this string length
 }
 
 int
@@ -253,6 +253,7 @@ main(int argc, char **argv)
 
 	while (1) {
 		char *buf;
+		pid_t w;
 
 		buf = readline(interactive ? "$ " : NULL);
 		if (buf == NULL) {
@@ -272,6 +273,16 @@ main(int argc, char **argv)
 			printf("%s\n", files->fi[files->cwd].de.d_name);
 			continue;
 		}
+
+		// A trailing '&' runs the command in the background.
+		int bg = 0, len = strlen(buf);
+		while (len > 0 && strchr(WHITESPACE, buf[len-1]))
+			len--;
+		if (len > 0 && buf[len-1] == '&') {
+			buf[len-1] = 0;
+			bg = 1;
+		}
+
 		if (debug)
 			cprintf("BEFORE FORK\n");
 		if ((r = fork()) < 0)
@@ -281,8 +292,16 @@ main(int argc, char **argv)
 		if (r == 0) {
 			runcmd(buf);
 			exit(EXIT_SUCCESS);
-		} else
-			waitpid(r, NULL, 0);
+		}
+		if (bg) {
+			printf("[%d]\n", r);
+			continue;
+		}
+
+		// Wait for the foreground command, reaping any background
+		// commands that happen to finish first.
+		while ((w = waitpid(-1, NULL, 0)) >= 0 && w != r)
+			printf("[%d] done\n", w);
 	}
 }
 
@@ -9,7 +9,15 @@
  */
 
 #include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
 #include <inc/syscall.h>
+#include <inc/kinfo.h>
+#include <inc/mmu.h>
+#include <inc/vm.h>
+
+#define ALLVA		((void*) VM_USERLO)
+#define ALLSIZE		(VM_USERHI - VM_USERLO)
 
 void migrate(int node)
 {
@@ -18,6 +26,96 @@ void migrate(int node)
 	cprintf("testmigr: now on node %d.\n", node);
 }
 
+// Pages to touch after migrating, to time pulling them on demand.
+// Build the kernel with a different NET_PULLWIN to compare windows.
+#define PULLPAGES	256
+static uint8_t pullbuf[PULLPAGES][PAGESIZE];
+
+void
+pulltime(int node)
+{
+	int i;
+	for (i = 0; i < PULLPAGES; i++)
+		memset(pullbuf[i], i, PAGESIZE);
+	migrate(node);
+
+	uint64_t start = kinfo_time();
+	int bad = 0;
+	for (i = 0; i < PULLPAGES; i++)
+		bad += pullbuf[i][0] != (uint8_t) i;
+	uint64_t us = kinfo_time() - start;
+	assert(bad == 0);
+	cprintf("testmigr: pulled %d pages in %lld us\n", PULLPAGES, us);
+}
+
+// Fork a child process on the current node without starting it,
+// returning 0 in the child and 1 in the parent.
+int
+fork(uint8_t child)
+{
+	struct procstate ps;
+	memset(&ps, 0, sizeof(ps));
+
+	int isparent;
+	asm volatile(
+		"	movl	%%esi,%0;"
+		"	movl	%%edi,%1;"
+		"	movl	%%ebp,%2;"
+		"	movl	%%esp,%3;"
+		"	movl	$1f,%4;"
+		"	movl	$1,%5;"
+		"1:	"
+		: "=m" (ps.tf.regs.esi),
+		  "=m" (ps.tf.regs.edi),
+		  "=m" (ps.tf.regs.ebp),
+		  "=m" (ps.tf.esp),
+		  "=m" (ps.tf.eip),
+		  "=a" (isparent)
+		:
+		: "ebx", "ecx", "edx");
+	if (!isparent)
+		return 0;	// in the child
+
+	ps.tf.regs.eax = 0;	// isparent == 0 in the child
+	sys_put(SYS_REGS | SYS_COPY, child, &ps, ALLVA, ALLVA, ALLSIZE);
+	return 1;
+}
+
+// A buffer a child forked away from home still refers to
+// after we come home and change it.
+#define COWPAGES	4
+static uint8_t cowbuf[COWPAGES][PAGESIZE];
+
+// Check that pages home let another node refer to stay as they were
+// when we write them again after coming home with our old page tables.
+void
+cowcheck(int home, int away)
+{
+	int i, bad;
+	memset(cowbuf, 'a', sizeof(cowbuf));
+	migrate(away);
+	assert(cowbuf[0][0] == 'a');	// pull the page table, not the rest
+	if (!fork(1)) {
+		for (bad = i = 0; i < COWPAGES; i++)
+			bad += cowbuf[i][PAGESIZE-1] != 'a';
+		if (bad)
+			asm volatile("int3");
+		sys_ret();
+	}
+	migrate(home);
+	memset(cowbuf, 'b', sizeof(cowbuf));
+
+	struct procstate ps;
+	sys_put(SYS_START, (away << 8) | 1, NULL, NULL, NULL, 0);
+	sys_get(SYS_REGS, (away << 8) | 1, &ps, NULL, NULL, 0);
+	assert(ps.tf.trapno == T_SYSCALL);
+	sys_put(SYS_FREE, (away << 8) | 1, NULL, NULL, NULL, 0);
+	migrate(home);
+	for (i = 0; i < COWPAGES; i++)
+		assert(cowbuf[i][PAGESIZE-1] == 'b');
+	cprintf("testmigr: cowcheck passed\n");
+}
+
 int
 main()
 {
@@ -27,6 +125,20 @@ main()
 	migrate(1);
 	migrate(2);
 
+	// Time pulling a buffer over, page by page as we touch it.
+	pulltime(1);
+
+	// Go away and come back home without touching the buffer:
+	// home should keep its own copy rather than pull it back.
+	migrate(2);
+	migrate(1);
+	int i;
+	for (i = 0; i < PULLPAGES; i++)
+		assert(pullbuf[i][PAGESIZE-1] == (uint8_t) i);
+
+	// Come home to a buffer a child away from home still refers to.
+	cowcheck(1, 2);
+
 	printf("testmigr done\n");
 	return 0;
 }
@@ -14,6 +14,8 @@
 #include <inc/x86.h>
 #include <inc/mmu.h>
 #include <inc/vm.h>
+#include <inc/spsc.h>
+#include <inc/kinfo.h>
 
 
 #define STACKSIZE	PAGESIZE
@@ -328,6 +330,22 @@ memopcheck(void)
 	sys_get(SYS_PERM|SYS_READ, 0, NULL, NULL, dva2+ofs, PAGESIZE);
 	assert(*(volatile int*)(dva2+ofs) == 0xdeadbeef);	// survived?
 
+	// Test SYS_VEC: several memory operations in one get or put
+	sysmemvec pv[2] = {
+		{ SYS_COPY, sva, dva2, PTSIZE },
+		{ SYS_ZERO, NULL, dva, PTSIZE },
+	};
+	sys_put(SYS_VEC, 0, NULL, pv, NULL, 2);
+	sysmemvec gv[3] = {
+		{ SYS_COPY, dva2, dva, PTSIZE },
+		{ SYS_COPY, dva, dva2, PTSIZE },
+		{ SYS_PERM | SYS_READ, NULL, dva2, PAGESIZE },
+	};
+	sys_get(SYS_VEC, 0, NULL, gv, NULL, 3);
+	assert(memcmp(sva, dva, etext - start) == 0);
+	assert(*(volatile int*)dva2 == 0);
+	readfaulttest(dva2 + PAGESIZE);
+
 	cprintf("testvm: memopcheck passed\n");
 }
 
@@ -491,6 +509,445 @@ mergecheck()
 	cprintf("testvm: mergecheck passed\n");
 }
 
+static volatile int syncval[2];
+
+// Check that SYS_SYNC brings a stopped child back in line with us,
+// dropping its own writes and picking up ours, and that merging
+// against a snapshot taken along with it still works.
+void
+synccheck()
+{
+	syncval[0] = 1;
+	if (!fork(SYS_START, 2)) {
+		assert(syncval[0] == 1);
+		syncval[1] = 2;
+		sys_ret();
+	}
+	join(0, 2, T_SYSCALL);
+
+	syncval[0] = 3;
+	if (!fork(SYS_SYNC | SYS_SNAP | SYS_START, 2)) {
+		assert(syncval[0] == 3);
+		assert(syncval[1] == 0);
+		syncval[1] = 4;
+		sys_ret();
+	}
+	join(SYS_MERGE, 2, T_SYSCALL);
+	assert(syncval[1] == 4);
+	sys_put(SYS_FREE, 2, NULL, NULL, NULL, 0);
+
+	cprintf("testvm: synccheck passed\n");
+}
+
+// Check that SYS_FREE tears children down and their slots can be reused
+void
+freecheck()
+{
+	struct procstate ps;
+	int i;
+
+	// A freed child looks like one that was never created.
+	if (!fork(SYS_START, 0)) gentrap(T_DIVIDE);
+	join(0, 0, T_DIVIDE);
+	sys_put(SYS_FREE, 0, NULL, NULL, NULL, 0);
+	sys_get(SYS_REGS, 0, &ps, NULL, NULL, 0);
+	assert(ps.tf.trapno == 0 && ps.tf.eip == 0);
+
+	// Freeing a nonexistent child is harmless.
+	sys_put(SYS_FREE, 1, NULL, NULL, NULL, 0);
+
+	// Recycle the same slot many times, with and without snapshots,
+	// including a child that itself leaves a grandchild behind.
+	for (i = 0; i < 1000; i++) {
+		if (!fork(SYS_START | (i & 1 ? SYS_SNAP : 0), 0)) {
+			if (i % 100 == 0 && !fork(SYS_START, 0))
+				gentrap(T_SYSCALL);
+			if (i % 100 == 0)
+				join(0, 0, T_SYSCALL);
+			gentrap(T_SYSCALL);
+		}
+		join(0, 0, T_SYSCALL);
+		sys_put(SYS_FREE, 0, NULL, NULL, NULL, 0);
+	}
+
+	cprintf("testvm: freecheck passed\n");
+}
+
+// Check that scheduling weights can be set, kept, and are inherited
+void
+weightcheck()
+{
+	struct procstate ps;
+
+	// A fresh child inherits our weight; a put with weight 0 keeps it.
+	if (!fork(0, 0)) gentrap(T_SYSCALL);
+	sys_get(SYS_REGS, 0, &ps, NULL, NULL, 0);
+	assert(ps.weight == PROC_WEIGHT);
+	ps.weight = 3 * PROC_WEIGHT;
+	sys_put(SYS_REGS, 0, &ps, NULL, NULL, 0);
+	ps.weight = 0;
+	sys_put(SYS_REGS | SYS_START, 0, &ps, NULL, NULL, 0);
+	sys_get(SYS_REGS, 0, &ps, NULL, NULL, 0);
+	assert(ps.tf.trapno == T_SYSCALL);
+	assert(ps.weight == 3 * PROC_WEIGHT);
+	sys_put(SYS_FREE, 0, NULL, NULL, NULL, 0);
+
+	cprintf("testvm: weightcheck passed\n");
+}
+
+// Check CPU usage accounting, including usage folded in from freed children
+void
+usagecheck()
+{
+	struct procstate ps;
+	int i;
+
+	if (!fork(SYS_START, 0)) {
+		// A grandchild that makes 4 syscalls, then gets freed;
+		// the kernel may count more if it restarts some of them.
+		if (!fork(SYS_START, 0)) {
+			for (i = 0; i < 3; i++)
+				sys_get(0, 1, NULL, NULL, NULL, 0);
+			sys_ret();
+		}
+		join(0, 0, T_SYSCALL);
+		sys_put(SYS_FREE, 0, NULL, NULL, NULL, 0);
+		volatile int n = 0;
+		for (i = 0; i < 1000000; i++)
+			n++;
+		sys_ret();
+	}
+	join(0, 0, T_SYSCALL);
+	sys_get(SYS_REGS, 0, &ps, NULL, NULL, 0);
+	assert(ps.ru.nswitch >= 1);
+	assert(ps.ru.nsyscall >= 4);	// put, get (maybe restarted), put, ret
+	assert(ps.ru.utime > 0);
+	assert(ps.cru.nsyscall >= 4);	// get x3, ret
+	sys_put(SYS_FREE, 0, NULL, NULL, NULL, 0);
+
+	cprintf("testvm: usagecheck passed\n");
+}
+
+// Check SYS_ANY gets, which work with or without PFF_NONDET
+void
+anycheck()
+{
+	struct procstate ps;
+
+	assert(sys_getany(0, 2, 3, NULL, NULL, NULL, NULL, 0) == -1);
+	if (!fork(SYS_START, 2)) gentrap(T_DIVIDE);
+	if (!fork(SYS_START, 3)) gentrap(T_BRKPT);
+	int a = sys_getany(SYS_REGS, 2, 3, NULL, &ps, NULL, NULL, 0);
+	assert(a == 2 || a == 3);
+	assert(ps.tf.trapno == (a == 2 ? T_DIVIDE : T_BRKPT));
+	int b = sys_getany(SYS_REGS, 2, 3, NULL, &ps, NULL, NULL, 0);
+	assert(b == 5 - a);
+	assert(ps.tf.trapno == (b == 2 ? T_DIVIDE : T_BRKPT));
+	assert(sys_getany(0, 2, 3, NULL, NULL, NULL, NULL, 0) == -1);
+
+	// Children left out of the set keep their news for later
+	uint32_t set[256/32];		// one bit per child
+	memset(set, 0, sizeof(set));
+	set[0] = 1 << 3;
+	if (!fork(SYS_START, 2)) gentrap(T_DIVIDE);
+	if (!fork(SYS_START, 3)) gentrap(T_BRKPT);
+	assert(sys_getany(SYS_REGS, 2, 3, set, &ps, NULL, NULL, 0) == 3);
+	assert(ps.tf.trapno == T_BRKPT);
+	assert(sys_getany(0, 2, 3, set, NULL, NULL, NULL, 0) == -1);
+	assert(sys_getany(SYS_REGS, 2, 3, NULL, &ps, NULL, NULL, 0) == 2);
+	assert(ps.tf.trapno == T_DIVIDE);
+	sys_put(SYS_FREE, 2, NULL, NULL, NULL, 0);
+	sys_put(SYS_FREE, 3, NULL, NULL, NULL, 0);
+
+	cprintf("testvm: anycheck passed\n");
+}
+
+// Check batched gets and puts, which wait once for the whole set
+void
+batchcheck()
+{
+	struct procstate ps[2];
+	sysbatch v[2];
+	memset(v, 0, sizeof(v));
+
+	if (!fork(SYS_START, 2)) gentrap(T_DIVIDE);
+	if (!fork(SYS_START, 3)) gentrap(T_BRKPT);
+	v[0].child = 2;
+	v[1].child = 3;
+	v[0].flags = v[1].flags = SYS_REGS;
+	v[0].save = &ps[0];
+	v[1].save = &ps[1];
+	sys_batch(SYS_GET, v, 2);
+	assert(ps[0].tf.trapno == T_DIVIDE);
+	assert(ps[1].tf.trapno == T_BRKPT);
+
+	v[0].flags = v[1].flags = SYS_FREE;
+	sys_batch(SYS_PUT, v, 2);
+	assert(sys_getany(0, 2, 3, NULL, NULL, NULL, NULL, 0) == -1);
+
+	cprintf("testvm: batchcheck passed\n");
+}
+
+static sysring gcc_aligned(PAGESIZE) ring;
+
+// Check queued gets and puts run through a shared ring
+void
+ringcheck()
+{
+	struct procstate ps[2];
+	sysringcqe c;
+	int i, tags = 0;
+
+	if (!fork(0, 2)) gentrap(T_DIVIDE);
+	if (!fork(0, 3)) gentrap(T_BRKPT);
+	assert(sys_ringput(&ring, SYS_PUT | SYS_START, 2, NULL,
+			NULL, NULL, 0, 12) == 0);
+	assert(sys_ringput(&ring, SYS_PUT | SYS_START, 3, NULL,
+			NULL, NULL, 0, 13) == 0);
+	assert(sys_ringput(&ring, SYS_GET | SYS_REGS, 2, &ps[0],
+			NULL, NULL, 0, 22) == 0);
+	assert(sys_ringput(&ring, SYS_GET | SYS_REGS, 3, &ps[1],
+			NULL, NULL, 0, 23) == 0);
+	assert(sys_ringput(&ring, SYS_GET, 256, NULL,
+			NULL, NULL, 0, 99) == 0);	// invalid child
+
+	// The starts complete at once; the gets once the children stop.
+	assert(sys_ring(&ring, 5) == 5);
+	assert(ring.sqhead == ring.sqtail);
+	for (i = 0; i < 5; i++) {
+		assert(sys_ringget(&ring, &c) == 0);
+		assert(c.result == (c.data == 99 ? -1 : 0));
+		tags += c.data;
+	}
+	assert(tags == 12 + 13 + 22 + 23 + 99);
+	assert(sys_ringget(&ring, &c) < 0);
+	assert(ps[0].tf.trapno == T_DIVIDE);
+	assert(ps[1].tf.trapno == T_BRKPT);
+	assert(sys_ring(&ring, 1) == 0);	// nothing left to wait for
+
+	sys_put(SYS_FREE, 2, NULL, NULL, NULL, 0);
+	sys_put(SYS_FREE, 3, NULL, NULL, NULL, 0);
+
+	cprintf("testvm: ringcheck passed\n");
+}
+
+static uint8_t gcc_aligned(PAGESIZE) sharepg[PAGESIZE];
+
+// Check that SYS_SHARE memory is seen at once on both sides,
+// survives a later copy, and is left alone by merge.
+// Runs in child 2, to which we grant PFF_NONDET: as the root we always can,
+// and the kernel refuses the grant only if we neither are nor have it.
+// A child without PFF_NONDET must get T_GPFLT for SYS_SHARE.
+void
+sharecheck()
+{
+	struct procstate ps;
+	spsc *q = (spsc *) sharepg;
+	int i, v;
+
+	if (!fork(0, 2)) {
+		assert(spsc_init(q, PAGESIZE, sizeof(int)) > 0);
+		if (!fork(0, 3)) {
+			for (i = 1; i <= 10; i++)
+				assert(spsc_push(q, &i) == 0);
+			sys_ret();
+		}
+		sys_put(SYS_SHARE | SYS_START, 3, NULL,
+			sharepg, sharepg, PAGESIZE);
+		sys_get(0, 3, NULL, NULL, NULL, 0);
+		for (i = 1; i <= 10; i++) {
+			assert(spsc_pop(q, &v) == 0);
+			assert(v == i);
+		}
+		assert(spsc_pop(q, &v) < 0);
+
+		// A copied and merged grandchild still shares the page
+		if (!fork(SYS_START | SYS_SNAP, 4)) {
+			v = 11;
+			assert(spsc_push(q, &v) == 0);
+			sys_ret();
+		}
+		join(SYS_MERGE, 4, T_SYSCALL);
+		assert(spsc_pop(q, &v) == 0);
+		assert(v == 11);
+		sys_ret();
+	}
+	sys_get(SYS_REGS, 2, &ps, NULL, NULL, 0);
+	ps.pff |= PFF_NONDET;
+	sys_put(SYS_REGS, 2, &ps, NULL, NULL, 0);
+	sys_get(SYS_REGS, 2, &ps, NULL, NULL, 0);
+	bool nondet = (ps.pff & PFF_NONDET) != 0;
+	sys_put(SYS_START, 2, NULL, NULL, NULL, 0);
+	sys_get(SYS_REGS, 2, &ps, NULL, NULL, 0);
+	assert(ps.tf.trapno == (nondet ? T_SYSCALL : T_GPFLT));
+	sys_put(SYS_FREE, 2, NULL, NULL, NULL, 0);
+
+	// Children don't get PFF_NONDET unless their parent grants it
+	if (!fork(0, 2)) {
+		sys_put(SYS_SHARE, 3, NULL, sharepg, sharepg, PAGESIZE);
+		sys_ret();
+	}
+	sys_get(SYS_REGS, 2, &ps, NULL, NULL, 0);
+	assert(!(ps.pff & PFF_NONDET));
+	sys_put(SYS_START, 2, NULL, NULL, NULL, 0);
+	sys_get(SYS_REGS, 2, &ps, NULL, NULL, 0);
+	assert(ps.tf.trapno == T_GPFLT);
+	sys_put(SYS_FREE, 2, NULL, NULL, NULL, 0);
+
+	cprintf("testvm: sharecheck passed%s\n",
+		nondet ? "" : " (not root: no PFF_NONDET to grant)");
+}
+
+// Check that the kernel info page is there, sane, and read-only
+void
+kinfocheck()
+{
+	assert(kinfo_ncpu() >= 1);
+	assert(kinfo_tscpu() > 0);
+	assert(kinfo_node() >= 0 && kinfo_node() <= KINFO_MAXNODES);
+	uint64_t t = kinfo_time();
+	assert(kinfo_time() >= t);
+
+	if (!fork(SYS_START, 2)) {
+		*(volatile uint32_t *) VM_KINFO = 0;
+		sys_ret();
+	}
+	join(0, 2, T_PGFLT);
+	sys_put(SYS_FREE, 2, NULL, NULL, NULL, 0);
+
+	cprintf("testvm: kinfocheck passed\n");
+}
+
+#define UPCALLVA	(VM_SCRATCHHI - 2*PAGESIZE)
+
+static int upcalls;
+
+// Fault handler that just grants access to the faulting page
+static void
+upcallhandler(upcallframe *uf)
+{
+	assert(uf->fva == UPCALLVA + 12);
+	upcalls++;
+	sys_get(SYS_PERM | SYS_RW, 7, NULL, NULL,
+		(void*) ROUNDDOWN(uf->fva, PAGESIZE), PAGESIZE);
+}
+
+// Check that page faults can go to a handler in the same process
+void
+upcallcheck()
+{
+	if (!fork(SYS_START, 2)) {
+		volatile int *ip = (volatile int*) (UPCALLVA + 12);
+		sys_get(SYS_PERM, 7, NULL, NULL, (void*) UPCALLVA, PAGESIZE);
+		set_pgfault_handler(upcallhandler);
+		assert(*ip == 0);	// faults once, then reads zero memory
+		*ip = 42;
+		assert(*ip == 42);
+		assert(upcalls == 1);
+		set_pgfault_handler(NULL);
+		sys_ret();
+	}
+	join(0, 2, T_SYSCALL);
+	sys_put(SYS_FREE, 2, NULL, NULL, NULL, 0);
+
+	cprintf("testvm: upcallcheck passed\n");
+}
+
+#define ADVISEVA	VM_SCRATCHLO
+#define ADVISEPG(i)	(*(volatile uint32_t *) (ADVISEVA + (i) * PAGESIZE))
+
+// Check that memory advice populates, discards and faults around
+// ranges of pages, leaving the pages' permissions alone.
+void
+advisecheck()
+{
+	int i;
+
+	if (!fork(SYS_START, 2)) {
+		sys_get(SYS_PERM | SYS_RW | SYS_WILLNEED, 7, NULL, NULL,
+			(void*) ADVISEVA, 4*PAGESIZE);
+		for (i = 0; i < 4; i++) {
+			assert(ADVISEPG(i) == 0);
+			ADVISEPG(i) = i + 1;
+		}
+
+		// Drop just the middle two pages, which stay writable
+		sys_get(SYS_DONTNEED, 7, NULL, NULL,
+			(void*) ADVISEVA + PAGESIZE, 2*PAGESIZE);
+		assert(ADVISEPG(0) == 1 && ADVISEPG(3) == 4);
+		assert(ADVISEPG(1) == 0 && ADVISEPG(2) == 0);
+		ADVISEPG(1) = 42;
+		assert(ADVISEPG(1) == 42);
+
+		// Drop them all and write them back in order with fault-around
+		sys_get(SYS_DONTNEED | SYS_SEQUENTIAL, 7, NULL, NULL,
+			(void*) ADVISEVA, 4*PAGESIZE);
+		for (i = 0; i < 4; i++) {
+			assert(ADVISEPG(i) == 0);
+			ADVISEPG(i) = i + 5;
+		}
+		for (i = 0; i < 4; i++)
+			assert(ADVISEPG(i) == i + 5);
+		sys_get(SYS_SEQUENTIAL, 7, NULL, NULL, (void*) ADVISEVA, 0);
+		sys_ret();
+	}
+	join(0, 2, T_SYSCALL);
+
+	// Advice only works on whole pages
+	if (!fork(SYS_START, 2)) {
+		sys_get(SYS_WILLNEED, 7, NULL, NULL,
+			(void*) ADVISEVA + 12, PAGESIZE);
+		sys_ret();
+	}
+	join(0, 2, T_GPFLT);
+	sys_put(SYS_FREE, 2, NULL, NULL, NULL, 0);
+
+	cprintf("testvm: advisecheck passed\n");
+}
+
+static const uint32_t gcc_aligned(16) fpupat[4] =
+	{ 0x01234567, 0x89abcdef, 0xdeadbeef, 0xfeedface };
+
+// Check that each process has private FPU/SSE state,
+// and that SYS_FPU transfers it between parent and child.
+void
+fpucheck()
+{
+	uint32_t gcc_aligned(16) mine[4] = { 1, 2, 3, 4 };
+	uint32_t gcc_aligned(16) got[4];
+	struct procstate ps;
+
+	// A child's XMM0 must not clobber ours, but we can GET it.
+	asm volatile("movaps %0,%%xmm0" : : "m" (mine));
+	if (!fork(SYS_START, 0)) {
+		asm volatile("movaps %0,%%xmm0" : : "m" (fpupat));
+		sys_ret();
+	}
+	sys_get(SYS_REGS | SYS_FPU, 0, &ps, NULL, NULL, 0);
+	assert(ps.tf.trapno == T_SYSCALL);
+	assert(ps.pff & PFF_USEFPU);
+	assert(memcmp(ps.fx.xmm[0], fpupat, 16) == 0);
+	asm volatile("movaps %%xmm0,%0" : "=m" (got));
+	assert(memcmp(got, mine, 16) == 0);
+
+	// PUT an FPU state into a not-yet-started child and read it back.
+	if (!fork(0, 1)) {
+		asm volatile("movaps %xmm0,%xmm1");
+		sys_ret();
+	}
+	sys_get(SYS_REGS | SYS_FPU, 1, &ps, NULL, NULL, 0);
+	ps.pff |= PFF_USEFPU;
+	ps.fx.fcw = 0x037f;
+	ps.fx.mxcsr = 0x1f80;
+	memmove(ps.fx.xmm[0], fpupat, 16);
+	sys_put(SYS_REGS | SYS_FPU | SYS_START, 1, &ps, NULL, NULL, 0);
+	sys_get(SYS_REGS | SYS_FPU, 1, &ps, NULL, NULL, 0);
+	assert(ps.tf.trapno == T_SYSCALL);
+	assert(memcmp(ps.fx.xmm[1], fpupat, 16) == 0);
+
+	cprintf("testvm: fpucheck passed\n");
+}
+
 int
 main()
 {
@@ -500,6 +957,18 @@ main()
 	protcheck();
 	memopcheck();
 	mergecheck();
+	synccheck();
+	freecheck();
+	weightcheck();
+	usagecheck();
+	anycheck();
+	batchcheck();
+	ringcheck();
+	sharecheck();
+	kinfocheck();
+	upcallcheck();
+	advisecheck();
+	fpucheck();
 
 	cprintf("testvm: all tests completed successfully!\n");
 	return 0;